@@ -44,8 +44,10 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -53,6 +55,7 @@
 
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
@@ -62,6 +65,27 @@
 #define MAX_LINE_LENGTH 512
 #define MAX_URL_LENGTH 256
 
+/*
+ Received data is collected until this much is pending, and then written and
+ hashed at once, instead of once for every read from the network.
+*/
+#define IMAGE_BUFFER_SIZE (64 * 1024)
+
+/* Segmented downloads don't split the image into smaller parts than this */
+#define MIN_SEGMENT_SIZE (256 * 1024)
+
+/*
+ Segments give up on a source that hasn't sent anything for this long, and
+ continue on the next one
+*/
+#define SEGMENT_TIMEOUT_MSEC 15000
+
+/* Mirrors that haven't answered a probe by then are considered unreachable */
+#define PROBE_TIMEOUT_MSEC 5000
+
+/* Mirrors are compared by the expected time for the download of an image of this size */
+#define SCORE_IMAGE_SIZE (8 * 1024 * 1024)
+
 
 #define STRINGIFY(str) #str
 
@@ -70,6 +94,8 @@ static const char *const abort_d_dir = "/usr/lib/autoupdater/abort.d";
 static const char *const upgrade_d_dir = "/usr/lib/autoupdater/upgrade.d";
 static const char *const lockfile = "/var/lock/autoupdater.lock";
 static const char *const firmware_path = "/tmp/firmware.bin";
+static const char *const firmware_state_path = "/tmp/firmware.bin.state";
+static const char *const mirror_state_path = "/tmp/autoupdater-mirrors";
 static const char *const sysupgrade_path = "/sbin/sysupgrade";
 
 struct recv_manifest_ctx {
@@ -77,11 +103,86 @@ struct recv_manifest_ctx {
 	struct manifest m;
 	char buf[MAX_LINE_LENGTH + 1];
 	char *ptr;
+
+	/* raw copy of the manifest for the cache */
+	char *data;
+	size_t data_len;
 };
 
 struct recv_image_ctx {
 	int fd;
+	int state_fd;
 	ecdsa_sha256_context_t hash_ctx;
+
+	/* the firmware file mapped into memory; NULL if it couldn't be reserved in full */
+	char *map;
+	size_t map_len;
+	/* buffer for data that hasn't been written yet when the file isn't mapped */
+	char *buf;
+
+	/* end of the contiguous data received so far */
+	off_t pos;
+	/* all data before this offset has been hashed (and written) */
+	off_t hashed;
+
+	time_t progress_time;
+};
+
+/* What is known about a mirror from probes and earlier runs */
+struct mirror_state {
+	const char *url;
+
+	/* smoothed time until a probe was answered in seconds, 0 if unknown */
+	float rtt;
+	/* smoothed image download speed in bytes per second, 0 if unknown */
+	float throughput;
+	unsigned failures;
+
+	/* the mirror has answered the probe of this run */
+	bool responsive;
+};
+
+struct mirror_probe {
+	struct mirror_state *mirror;
+	struct uclient *cl;
+	struct uclient_data d;
+	double start;
+	bool done;
+
+	size_t *pending;
+};
+
+struct segmented_image_ctx;
+
+struct image_segment {
+	struct segmented_image_ctx *ctx;
+	struct uclient *cl;
+	struct uclient_data d;
+	struct uloop_timeout restart;
+
+	/* index of the URL the segment is currently downloaded from */
+	size_t source;
+	size_t failures;
+
+	off_t pos;
+	off_t end;
+};
+
+struct segmented_image_ctx {
+	struct recv_image_ctx *image;
+	char (*urls)[MAX_URL_LENGTH];
+	size_t n_urls;
+
+	struct image_segment *segments;
+	size_t n_segments;
+	size_t n_done;
+
+	/* first segment that has not been completely fed into the hash */
+	size_t hashed_segment;
+
+	off_t downloaded;
+	off_t size;
+	bool failed;
 };
 
 struct updater_url_fmt {
@@ -105,6 +206,8 @@ static void usage(void) {
 		"  --fallback           Upgrade if and only if the upgrade timespan of the new\n"
 		"                       version has passed for at least 24 hours.\n\n"
 		"  --force-version      Skip version check to allow downgrades.\n\n"
+		"  --segments N         Download the image in N parts at once, spread over\n"
+		"                       all mirrors.\n\n"
 		"  <mirror> ...         Override the mirror URLs given in the configuration. If\n"
 		"                       specified, these are not shuffled.\n\n",
 		stderr
@@ -120,6 +223,7 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
 		OPTION_NO_ACTION = 'n',
 		OPTION_FALLBACK = 256,
 		OPTION_FORCE_VERSION = 257,
+		OPTION_SEGMENTS = 258,
 	};
 
 	const struct option options[] = {
@@ -128,6 +232,7 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
 		{"fallback",  no_argument,       NULL, OPTION_FALLBACK},
 		{"no-action", no_argument,       NULL, OPTION_NO_ACTION},
 		{"force-version", no_argument, NULL, OPTION_FORCE_VERSION},
+		{"segments",  required_argument, NULL, OPTION_SEGMENTS},
 		{"help",      no_argument,       NULL, OPTION_HELP},
 	};
 
@@ -161,6 +266,16 @@ static void parse_args(int argc, char *argv[], struct settings *settings) {
 			settings->force_version = true;
 			break;
 
+		case OPTION_SEGMENTS: {
+			char *end;
+			settings->segments = strtoul(optarg, &end, 10);
+			if (*end || !settings->segments) {
+				usage();
+				exit(1);
+			}
+			break;
+		}
+
 		default:
 			usage();
 			exit(1);
@@ -241,6 +356,13 @@ static void recv_manifest_cb(struct uclient *cl) {
 		len = uclient_read_account(cl, ctx->ptr, MAX_LINE_LENGTH - (ctx->ptr - ctx->buf));
 		if (len <= 0)
 			break;
+
+		if (ctx->data_len + len <= MAX_MANIFEST_CACHE_SIZE) {
+			ctx->data = safe_realloc(ctx->data, ctx->data_len + len);
+			memcpy(ctx->data + ctx->data_len, ctx->ptr, len);
+		}
+		ctx->data_len += len;
+
 		ctx->ptr[len] = '\0';
 
 		char *line = ctx->buf;
@@ -264,31 +386,433 @@ static void recv_manifest_cb(struct uclient *cl) {
 }
 
 
+/** Records the length of the hashed beginning of the file in the state file */
+static bool record_progress(struct recv_image_ctx *ctx) {
+	uint64_t len = ctx->hashed;
+	return pwrite(ctx->state_fd, &len, sizeof(len), ECDSA_SHA256_HASH_SIZE) == sizeof(len);
+}
+
+/** Writes and hashes the data received since the last call */
+static bool flush_image(struct recv_image_ctx *ctx) {
+	size_t len = ctx->pos - ctx->hashed;
+	const char *data = ctx->map ? ctx->map + ctx->hashed : ctx->buf;
+
+	if (!len)
+		return true;
+
+	if (!ctx->map && write(ctx->fd, data, len) != (ssize_t)len)
+		return false;
+
+	ecdsa_sha256_update(&ctx->hash_ctx, data, len);
+	ctx->hashed = ctx->pos;
+
+	return record_progress(ctx);
+}
+
+/** Prints the download progress, at most once per second until the download is complete */
+static void print_progress(struct recv_image_ctx *ctx, off_t downloaded, off_t size) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec == ctx->progress_time && downloaded != size)
+		return;
+	ctx->progress_time = now.tv_sec;
+
+	printf(
+		"\rDownloading image: % 5lli / %lli KiB",
+		(long long)downloaded / 1024,
+		(long long)size / 1024
+	);
+	fflush(stdout);
+}
+
 /** Receives data from uclient and writes it to file */
 static void recv_image_cb(struct uclient *cl) {
 	struct recv_image_ctx *ctx = uclient_get_custom(cl);
-	char buf[1024];
-	int len;
 
 	while (true) {
-		len = uclient_read_account(cl, buf, sizeof(buf));
-		if (len <= 0)
+		/* Receive directly into the mapped file if possible */
+		char *buf, excess;
+		size_t len;
+		if (ctx->map) {
+			buf = ctx->map + ctx->pos;
+			len = ctx->map_len - ctx->pos;
+		}
+		else {
+			buf = ctx->buf + (ctx->pos - ctx->hashed);
+			len = IMAGE_BUFFER_SIZE - (ctx->pos - ctx->hashed);
+		}
+		if (!len) {
+			/* Read any excess data anyway, so uclient_read_account() notices it */
+			buf = &excess;
+			len = 1;
+		}
+		else if (len > INT_MAX) {
+			len = INT_MAX;
+		}
+
+		int r = uclient_read_account(cl, buf, len);
+		if (r <= 0)
+			break;
+
+		ctx->pos += r;
+
+		if (ctx->pos - ctx->hashed >= IMAGE_BUFFER_SIZE && !flush_image(ctx)) {
+			fputs("\nautoupdater: error: downloading firmware image failed: ", stderr);
+			perror(NULL);
+			abort_url(cl);
 			return;
+		}
+	}
 
-		printf(
-			"\rDownloading image: % 5zi / %zi KiB",
-			uclient_data(cl)->downloaded / 1024,
-			uclient_data(cl)->length / 1024
-		);
-		fflush(stdout);
+	print_progress(ctx, uclient_data(cl)->downloaded, uclient_data(cl)->length);
+}
+
+/**
+ * Prepares the firmware file for the download of the image described by the manifest.
+ *
+ * If the file contains the beginning of the same image from an earlier, interrupted
+ * download, the part recorded as hashed in the state file is kept and fed into the
+ * hash context. Everything after it is truncated.
+ *
+ * Returns the number of bytes already downloaded, or -1 on error.
+ */
+static off_t resume_image(struct recv_image_ctx *ctx, const struct manifest *m) {
+	off_t offset = 0;
+
+	ctx->state_fd = open(firmware_state_path, O_RDWR|O_CREAT, 0600);
+	if (ctx->state_fd < 0)
+		return -1;
+
+	/* The state file contains the image hash, followed by the length of the hashed part */
+	unsigned char hash[ECDSA_SHA256_HASH_SIZE];
+	uint64_t hashed;
+	struct stat st;
+
+	if (pread(ctx->state_fd, hash, sizeof(hash), 0) == sizeof(hash)
+			&& pread(ctx->state_fd, &hashed, sizeof(hashed), sizeof(hash)) == sizeof(hashed)
+			&& !memcmp(hash, m->image_hash, sizeof(hash))
+			&& m->imagesize >= 0 && hashed <= (uint64_t)m->imagesize
+			&& !fstat(ctx->fd, &st) && (uint64_t)st.st_size >= hashed)
+		offset = hashed;
+
+	/* Re-prime the hash with the data we already have */
+	off_t pos = 0;
+	while (pos < offset) {
+		char buf[4096];
+		size_t len = sizeof(buf);
+		if (offset - pos < (off_t)len)
+			len = offset - pos;
+
+		ssize_t r = read(ctx->fd, buf, len);
+		if (r <= 0)
+			break;
+
+		ecdsa_sha256_update(&ctx->hash_ctx, buf, r);
+		pos += r;
+	}
+	ctx->hashed = offset = pos;
+
+	/* Record which image the file is going to contain */
+	if (ftruncate(ctx->fd, offset) || lseek(ctx->fd, offset, SEEK_SET) != offset
+			|| pwrite(ctx->state_fd, m->image_hash, ECDSA_SHA256_HASH_SIZE, 0) != ECDSA_SHA256_HASH_SIZE
+			|| !record_progress(ctx)) {
+		close(ctx->state_fd);
+		return -1;
+	}
+
+	return offset;
+}
+
+/**
+ * Sets up the output for the download of the rest of the image.
+ *
+ * If the image size is known and the space for it can be reserved, the file is
+ * extended to it and mapped into memory, so the data can be received into its
+ * final place right away. Reserving the space first ensures that running out of
+ * memory results in an error instead of a SIGBUS when the mapping is written to.
+ */
+static void open_image_output(struct recv_image_ctx *ctx, off_t offset, ssize_t size) {
+	ctx->pos = ctx->hashed = offset;
+
+	if (size > 0 && !posix_fallocate(ctx->fd, 0, size)) {
+		ctx->map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+		if (ctx->map != MAP_FAILED) {
+			ctx->map_len = size;
+			return;
+		}
+
+		ctx->map = NULL;
+	}
+
+	/* Fall back to writing the data out; space that was reserved is released again */
+	if (ftruncate(ctx->fd, offset))
+		fputs("autoupdater: warning: failed to truncate firmware file\n", stderr);
 
-		if (write(ctx->fd, buf, len) < len) {
-			fputs("autoupdater: error: downloading firmware image failed: ", stderr);
+	ctx->buf = safe_malloc(IMAGE_BUFFER_SIZE);
+}
+
+/**
+ * Writes out pending data and closes the firmware file.
+ *
+ * The file is truncated to the data that has been received contiguously, so a
+ * later run can resume the download from there.
+ */
+static bool close_image_output(struct recv_image_ctx *ctx) {
+	bool ok = flush_image(ctx);
+
+	if (ctx->map) {
+		munmap(ctx->map, ctx->map_len);
+		ctx->map = NULL;
+	}
+
+	if (ftruncate(ctx->fd, ctx->hashed))
+		ok = false;
+
+	free(ctx->buf);
+	ctx->buf = NULL;
+
+	if (close(ctx->fd))
+		ok = false;
+	close(ctx->state_fd);
+
+	return ok;
+}
+
+/** Feeds the data of completed segments following the hashed part of the image into the hash */
+static bool hash_segments(struct segmented_image_ctx *ctx) {
+	struct recv_image_ctx *image = ctx->image;
+
+	while (ctx->hashed_segment < ctx->n_segments) {
+		struct image_segment *seg = &ctx->segments[ctx->hashed_segment];
+
+		if (image->map) {
+			ecdsa_sha256_update(&image->hash_ctx, image->map + image->hashed, seg->pos - image->hashed);
+			image->hashed = seg->pos;
+		}
+
+		while (image->hashed < seg->pos) {
+			size_t len = IMAGE_BUFFER_SIZE;
+			if (seg->pos - image->hashed < (off_t)len)
+				len = seg->pos - image->hashed;
+
+			ssize_t r = pread(image->fd, image->buf, len, image->hashed);
+			if (r <= 0)
+				return false;
+
+			ecdsa_sha256_update(&image->hash_ctx, image->buf, r);
+			image->hashed += r;
+		}
+
+		if (seg->pos < seg->end)
+			break;
+
+		ctx->hashed_segment++;
+	}
+
+	return record_progress(image);
+}
+
+/** Receives data of a segment from uclient and writes it to its place in the file */
+static void recv_segment_cb(struct uclient *cl) {
+	struct image_segment *seg = uclient_get_custom(cl);
+	struct segmented_image_ctx *ctx = seg->ctx;
+	struct recv_image_ctx *image = ctx->image;
+
+	while (!ctx->failed) {
+		char *buf, excess;
+		size_t len;
+		if (image->map) {
+			buf = image->map + seg->pos;
+			len = seg->end - seg->pos;
+		}
+		else {
+			buf = image->buf;
+			len = IMAGE_BUFFER_SIZE;
+		}
+		if (!len) {
+			/* Read any excess data anyway, so uclient_read_account() notices it */
+			buf = &excess;
+			len = 1;
+		}
+		else if (len > INT_MAX) {
+			len = INT_MAX;
+		}
+
+		int r = uclient_read_account(cl, buf, len);
+		if (r <= 0)
+			break;
+
+		if (!image->map && pwrite(image->fd, buf, r, seg->pos) < r) {
+			fputs("\nautoupdater: error: downloading firmware image failed: ", stderr);
 			perror(NULL);
+			ctx->failed = true;
+			uloop_end();
 			return;
 		}
-		ecdsa_sha256_update(&ctx->hash_ctx, buf, len);
+
+		seg->pos += r;
+		ctx->downloaded += r;
 	}
+
+	/* Hash in large blocks as data directly following the hashed part comes in */
+	if (seg == &ctx->segments[ctx->hashed_segment] && seg->pos - image->hashed >= IMAGE_BUFFER_SIZE
+			&& !hash_segments(ctx)) {
+		fputs("\nautoupdater: error: failed reading back firmware image\n", stderr);
+		ctx->failed = true;
+		uloop_end();
+		return;
+	}
+
+	print_progress(image, ctx->downloaded, ctx->size);
+}
+
+static void segment_failed(struct image_segment *seg, int err_code) {
+	struct segmented_image_ctx *ctx = seg->ctx;
+
+	fprintf(stderr, "\nautoupdater: warning: error downloading image segment from '%s': %s\n",
+		ctx->urls[seg->source], uclient_get_errmsg(err_code));
+
+	/* Give up when the segment has failed on every source */
+	if (++seg->failures >= ctx->n_urls) {
+		ctx->failed = true;
+		uloop_end();
+		return;
+	}
+
+	/* Continue where the segment has stopped, using the next source */
+	seg->source = (seg->source + 1) % ctx->n_urls;
+	uloop_timeout_set(&seg->restart, 0);
+}
+
+static void segment_done_cb(struct uclient *cl) {
+	struct image_segment *seg = uclient_get_custom(cl);
+	struct segmented_image_ctx *ctx = seg->ctx;
+
+	if (ctx->failed)
+		return;
+
+	if (seg->d.err_code) {
+		segment_failed(seg, seg->d.err_code);
+		return;
+	}
+
+	if (!hash_segments(ctx)) {
+		fputs("\nautoupdater: error: failed reading back firmware image\n", stderr);
+		ctx->failed = true;
+		uloop_end();
+		return;
+	}
+
+	if (++ctx->n_done == ctx->n_segments)
+		uloop_end();
+}
+
+static bool start_segment(struct image_segment *seg) {
+	seg->d = (struct uclient_data){
+		.custom = seg,
+		.done_cb = segment_done_cb,
+		.offset = seg->pos,
+		.length = seg->end,
+		.range = true,
+		.timeout = SEGMENT_TIMEOUT_MSEC,
+	};
+
+	seg->cl = start_url(seg->ctx->urls[seg->source], recv_segment_cb, &seg->d);
+	return seg->cl;
+}
+
+static void restart_segment(struct uloop_timeout *timeout) {
+	struct image_segment *seg = container_of(timeout, struct image_segment, restart);
+
+	/* The old client can't be freed from its own callbacks, so it is done here */
+	if (seg->cl)
+		finish_url(seg->cl);
+
+	if (!start_segment(seg))
+		segment_failed(seg, UCLIENT_ERROR_CONNECT);
+}
+
+/**
+ * Downloads the rest of the image in n_segments parts at once, which are
+ * distributed over the given URLs and written to their place in the file.
+ *
+ * The data is hashed in order as contiguous parts of the image are completed. If
+ * the download fails, only the part that has been hashed is kept, so the rest
+ * can be fetched in the usual way.
+ *
+ * Returns the length of the hashed beginning of the image, or -1 on error.
+ */
+static off_t download_segmented(struct recv_image_ctx *image_ctx, char (*urls)[MAX_URL_LENGTH], size_t n_urls,
+				size_t n_segments, off_t offset, off_t size) {
+	struct image_segment segments[n_segments];
+	struct segmented_image_ctx ctx = {
+		.image = image_ctx,
+		.urls = urls,
+		.n_urls = n_urls,
+		.segments = segments,
+		.n_segments = n_segments,
+		.downloaded = offset,
+		.size = size,
+	};
+
+	for (size_t i = 0; i < n_segments; i++) {
+		segments[i] = (struct image_segment){
+			.ctx = &ctx,
+			.restart.cb = restart_segment,
+			.source = i % n_urls,
+			.pos = offset + (size - offset) * i / n_segments,
+			.end = offset + (size - offset) * (i + 1) / n_segments,
+		};
+	}
+
+	for (size_t i = 0; i < n_segments && !ctx.failed; i++) {
+		if (!start_segment(&segments[i]))
+			segment_failed(&segments[i], UCLIENT_ERROR_CONNECT);
+	}
+
+	if (!ctx.failed)
+		uloop_run();
+	puts("");
+
+	for (size_t i = 0; i < n_segments; i++) {
+		uloop_timeout_cancel(&segments[i].restart);
+		if (segments[i].cl)
+			finish_url(segments[i].cl);
+	}
+
+	/* Everything after the hashed part has to be downloaded again */
+	image_ctx->pos = image_ctx->hashed;
+	if (!image_ctx->map) {
+		if (ftruncate(image_ctx->fd, image_ctx->hashed) || lseek(image_ctx->fd, image_ctx->hashed, SEEK_SET) != image_ctx->hashed)
+			return -1;
+	}
+
+	return image_ctx->hashed;
+}
+
+/** Parses a cached manifest like one that has just been downloaded */
+static void parse_cached_manifest(struct recv_manifest_ctx *ctx, struct manifest_cache *cache) {
+	char *line = cache->data;
+
+	while (line < cache->data + cache->data_len) {
+		char *newline = strchr(line, '\n');
+		if (!newline)
+			break;
+		*newline = '\0';
+
+		parse_line(line, &ctx->m, ctx->s->branch, platforminfo_get_image_name());
+		line = newline + 1;
+	}
+}
+
+/** Hashes the configured public keys, so cached verification results can be matched to them */
+static void hash_pubkeys(const struct settings *s, ecc_int256_t *hash) {
+	ecdsa_sha256_context_t ctx;
+
+	ecdsa_sha256_init(&ctx);
+	ecdsa_sha256_update(&ctx, s->pubkeys, s->n_pubkeys * sizeof(*s->pubkeys));
+	ecdsa_sha256_final(&ctx, hash->p);
 }
 
 typedef int (*manifest_url_cb)(char *manifest_url, size_t url_len, const struct settings *s, void *priv);
@@ -300,8 +824,22 @@ struct updater_url_ctx {
 
 	image_url_cb image_url_cb;
 	void *image_url_priv;
+
+	/* further sources for segmented downloads, passed to image_url_cb */
+	void **segment_url_privs;
+	size_t n_segment_url_privs;
+
+	/* the mirror the image is downloaded from, if any; its throughput is recorded */
+	struct mirror_state *mirror;
 };
 
+static void update_average(float *avg, float sample) {
+	if (*avg > 0)
+		*avg = 0.7f * *avg + 0.3f * sample;
+	else
+		*avg = sample;
+}
+
 #define URL_CB_OK(ret, max_len) ({ const typeof((ret)) __ret = ret; ((__ret) >= 0 && (__ret) < (max_len)); })
 
 static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx, int lock_fd) {
@@ -309,6 +847,7 @@ static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx
 	struct recv_manifest_ctx manifest_ctx = { .s = s };
 	manifest_ctx.ptr = manifest_ctx.buf;
 	struct manifest *m = &manifest_ctx.m;
+	struct manifest_cache cache = {};
 
 	/**** Get and check manifest *****************************************/
 	/* Construct manifest URL */
@@ -319,9 +858,21 @@ static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx
 
 	printf("Retrieving manifest from %s ...\n", manifest_url);
 
+	/* Only ask for the manifest if it has changed since it has been cached */
+	ecc_int256_t keys_hash;
+	hash_pubkeys(s, &keys_hash);
+
+	struct uclient_data manifest_req = { .custom = &manifest_ctx, .length = -1 };
+	if (load_manifest_cache(&cache, manifest_url, &keys_hash)) {
+		if (*cache.etag)
+			manifest_req.if_none_match = cache.etag;
+		if (*cache.last_modified)
+			manifest_req.if_modified_since = cache.last_modified;
+	}
+
 	/* Download manifest */
 	ecdsa_sha256_init(&m->hash_ctx);
-	int err_code = get_url(manifest_url, recv_manifest_cb, &manifest_ctx, -1);
+	int err_code = run_url(manifest_url, recv_manifest_cb, &manifest_req);
 	if (err_code != 0) {
 		fprintf(stderr, "autoupdater: warning: error downloading manifest: %s\n", uclient_get_errmsg(err_code));
 		goto out;
@@ -329,13 +880,34 @@ static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx
 
 	/* Check manifest signatures */
 	{
-		ecc_int256_t hash;
-		ecdsa_sha256_final(&m->hash_ctx, hash.p);
-		ecdsa_verify_context_t ctxs[m->n_signatures];
-		for (size_t i = 0; i < m->n_signatures; i++)
-			ecdsa_verify_prepare_legacy(&ctxs[i], &hash, m->signatures[i]);
+		long unsigned int good_signatures;
+
+		if (manifest_req.not_modified) {
+			puts("Manifest has not been modified, using cached copy.");
+
+			/* The signatures of the cached manifest have already been verified */
+			parse_cached_manifest(&manifest_ctx, &cache);
+			good_signatures = cache.good_signatures;
+		}
+		else {
+			ecc_int256_t hash;
+			ecdsa_sha256_final(&m->hash_ctx, hash.p);
+			ecdsa_verify_context_t ctxs[m->n_signatures];
+			for (size_t i = 0; i < m->n_signatures; i++)
+				ecdsa_verify_prepare_legacy(&ctxs[i], &hash, m->signatures[i]);
+
+			good_signatures = ecdsa_verify_list_legacy(ctxs, m->n_signatures, s->pubkeys, s->n_pubkeys);
+
+			const struct manifest_cache new_cache = {
+				.etag = manifest_req.etag,
+				.last_modified = manifest_req.last_modified,
+				.good_signatures = good_signatures,
+				.data = manifest_ctx.data,
+				.data_len = manifest_ctx.data_len,
+			};
+			save_manifest_cache(&new_cache, manifest_url, &keys_hash);
+		}
 
-		long unsigned int good_signatures = ecdsa_verify_list_legacy(ctxs, m->n_signatures, s->pubkeys, s->n_pubkeys);
 		if (good_signatures < s->good_signatures) {
 			fprintf(stderr, "autoupdater: warning: manifest %s only carried %lu valid signatures, %lu are required\n", manifest_url, good_signatures, s->good_signatures);
 			goto out;
@@ -376,31 +948,91 @@ static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx
 	run_dir(download_d_dir);
 
 	struct recv_image_ctx image_ctx = { };
-	image_ctx.fd = open(firmware_path, O_WRONLY|O_CREAT, 0600);
+	image_ctx.fd = open(firmware_path, O_RDWR|O_CREAT, 0600);
 	if (image_ctx.fd < 0) {
 		fprintf(stderr, "autoupdater: error: failed opening firmware file %s\n", firmware_path);
 		goto fail_after_download;
 	}
 
+	ecdsa_sha256_init(&image_ctx.hash_ctx);
+	off_t offset = resume_image(&image_ctx, m);
+	if (offset < 0) {
+		fprintf(stderr, "autoupdater: error: failed preparing firmware file %s\n", firmware_path);
+		close(image_ctx.fd);
+		goto fail_after_download;
+	}
+
+	open_image_output(&image_ctx, offset, m->imagesize);
+
 	/* Download image and calculate SHA256 checksum */
 	{
 		char image_url[MAX_URL_LENGTH];
 		if(!URL_CB_OK(url_ctx->image_url_cb(image_url, MAX_URL_LENGTH, s, m->image_filename, url_ctx->image_url_priv), MAX_URL_LENGTH)) {
+			close_image_output(&image_ctx);
 			goto fail_after_download;
 		}
 
-		printf("Downloading image from '%s'\n", image_url);
+		/* Split the rest of the image into segments if it is large enough */
+		size_t n_segments = 1;
+		if (m->imagesize >= 0) {
+			n_segments = (m->imagesize - offset) / MIN_SEGMENT_SIZE;
+			if (n_segments > s->segments)
+				n_segments = s->segments;
+		}
 
-		ecdsa_sha256_init(&image_ctx.hash_ctx);
-		int err_code = get_url(image_url, &recv_image_cb, &image_ctx, m->imagesize);
-		puts("");
-		if (err_code != 0) {
-			fprintf(stderr, "autoupdater: warning: error downloading image: %s\n", uclient_get_errmsg(err_code));
-			close(image_ctx.fd);
-			goto fail_after_download;
+		if (n_segments > 1) {
+			char image_urls[1 + url_ctx->n_segment_url_privs][MAX_URL_LENGTH];
+			size_t n_urls = 1;
+			strcpy(image_urls[0], image_url);
+
+			for (size_t i = 0; i < url_ctx->n_segment_url_privs; i++) {
+				if (URL_CB_OK(url_ctx->image_url_cb(image_urls[n_urls], MAX_URL_LENGTH, s, m->image_filename, url_ctx->segment_url_privs[i]), MAX_URL_LENGTH))
+					n_urls++;
+			}
+
+			printf("Downloading image in %zu segments from %zu sources\n", n_segments, n_urls);
+
+			offset = download_segmented(&image_ctx, image_urls, n_urls, n_segments, offset, m->imagesize);
+			if (offset < 0) {
+				fprintf(stderr, "autoupdater: error: failed preparing firmware file %s\n", firmware_path);
+				close_image_output(&image_ctx);
+				goto fail_after_download;
+			}
+
+			if (offset < m->imagesize)
+				fputs("autoupdater: warning: segmented download failed, continuing over a single connection\n", stderr);
+		}
+
+		if (offset == m->imagesize) {
+			if (n_segments <= 1)
+				printf("Image has already been downloaded to '%s'\n", firmware_path);
+		}
+		else {
+			if (offset)
+				printf("Resuming download of image from '%s' at %lld KiB\n", image_url, (long long)offset / 1024);
+			else
+				printf("Downloading image from '%s'\n", image_url);
+
+			double start = get_monotonic_time();
+			int err_code = get_url(image_url, &recv_image_cb, &image_ctx, m->imagesize, offset);
+			puts("");
+			if (err_code != 0) {
+				fprintf(stderr, "autoupdater: warning: error downloading image: %s\n", uclient_get_errmsg(err_code));
+				close_image_output(&image_ctx);
+				/* Keep the partial image, so the next run can resume the download */
+				goto abort_download;
+			}
+
+			double duration = get_monotonic_time() - start;
+			if (url_ctx->mirror && n_segments <= 1 && duration > 0)
+				update_average(&url_ctx->mirror->throughput, (image_ctx.pos - offset) / duration);
 		}
 	}
-	close(image_ctx.fd);
+
+	if (!close_image_output(&image_ctx)) {
+		fprintf(stderr, "autoupdater: error: failed writing firmware file %s\n", firmware_path);
+		goto fail_after_download;
+	}
 
 	/* Verify image checksum */
 	{
@@ -412,6 +1044,8 @@ static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx
 		}
 	}
 
+	unlink(firmware_state_path);
+
 	clear_manifest(m);
 
 	/**** Call sysupgrade ************************************************/
@@ -441,10 +1075,15 @@ static bool autoupdate(struct settings *s, const struct updater_url_ctx *url_ctx
 
 fail_after_download:
 	unlink(firmware_path);
+	unlink(firmware_state_path);
+
+abort_download:
 	run_dir(abort_d_dir);
 
 out:
 	clear_manifest(m);
+	clear_manifest_cache(&cache);
+	free(manifest_ctx.data);
 	return ret;
 }
 
@@ -507,6 +1146,198 @@ static int direct_image_url_cb(char *manifest_url, size_t url_len, const struct
 }
 
 
+static void load_mirror_states(const struct settings *s, struct mirror_state *states) {
+	for (size_t i = 0; i < s->n_mirrors; i++)
+		states[i] = (struct mirror_state){ .url = s->mirrors[i] };
+
+	/* A forged state could steer all downloads to a single mirror */
+	FILE *f = fopen_trusted(mirror_state_path);
+	if (!f)
+		return;
+
+	char *line = NULL;
+	size_t len = 0;
+
+	/* Each line contains the RTT, throughput and failure count of a mirror, followed by its URL */
+	while (getline(&line, &len, f) > 0) {
+		float rtt, throughput;
+		unsigned failures;
+		int pos;
+
+		if (sscanf(line, "%f %f %u %n", &rtt, &throughput, &failures, &pos) != 3)
+			continue;
+
+		char *url = line + pos;
+		url[strcspn(url, "\n")] = 0;
+
+		for (size_t i = 0; i < s->n_mirrors; i++) {
+			if (strcmp(states[i].url, url))
+				continue;
+
+			states[i].rtt = rtt;
+			states[i].throughput = throughput;
+			states[i].failures = failures;
+		}
+	}
+
+	free(line);
+	fclose(f);
+}
+
+static void save_mirror_states(const struct settings *s, const struct mirror_state *states) {
+	char tmp_path[strlen(mirror_state_path) + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", mirror_state_path);
+
+	/* The state lives in /tmp, so the temporary file must not be a symlink planted by someone else */
+	int fd = mkstemp(tmp_path);
+	if (fd < 0)
+		goto err;
+
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp_path);
+		goto err;
+	}
+
+	for (size_t i = 0; i < s->n_mirrors; i++)
+		fprintf(f, "%g %g %u %s\n", states[i].rtt, states[i].throughput, states[i].failures, states[i].url);
+
+	if (ferror(f) | fclose(f) || rename(tmp_path, mirror_state_path)) {
+		unlink(tmp_path);
+		goto err;
+	}
+
+	return;
+
+err:
+	fprintf(stderr, "autoupdater: warning: failed to save mirror state: %m\n");
+}
+
+static void probe_done_cb(struct uclient *cl) {
+	struct mirror_probe *probe = uclient_get_custom(cl);
+
+	if (probe->done)
+		return;
+	probe->done = true;
+
+	if (!probe->d.err_code) {
+		probe->mirror->responsive = true;
+		update_average(&probe->mirror->rtt, get_monotonic_time() - probe->start);
+
+		/* A successful probe decays the failure count by one */
+		if (probe->mirror->failures)
+			probe->mirror->failures--;
+	}
+
+	if (!--*probe->pending)
+		uloop_end();
+}
+
+static void probe_timeout_cb(struct uloop_timeout *timeout) {
+	uloop_end();
+}
+
+/** Sends a HEAD request for the manifest to all mirrors at once, recording how fast they answer */
+static void probe_mirrors(const struct settings *s, struct mirror_state *states) {
+	struct mirror_probe probes[s->n_mirrors];
+	struct uloop_timeout timeout = { .cb = probe_timeout_cb };
+	size_t pending = 0;
+
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		struct direct_cb_priv cb_priv = { states[i].url };
+		char url[MAX_URL_LENGTH];
+
+		probes[i] = (struct mirror_probe){
+			.mirror = &states[i],
+			.d = {
+				.custom = &probes[i],
+				.done_cb = probe_done_cb,
+				.length = -1,
+				.head = true,
+			},
+			.start = get_monotonic_time(),
+			.pending = &pending,
+		};
+
+		if (!URL_CB_OK(direct_manifest_url_cb(url, MAX_URL_LENGTH, s, &cb_priv), MAX_URL_LENGTH))
+			continue;
+
+		probes[i].cl = start_url(url, NULL, &probes[i].d);
+		if (probes[i].cl)
+			pending++;
+	}
+
+	if (pending) {
+		uloop_timeout_set(&timeout, PROBE_TIMEOUT_MSEC);
+		uloop_run();
+		uloop_timeout_cancel(&timeout);
+	}
+
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		if (probes[i].cl)
+			finish_url(probes[i].cl);
+
+		if (!states[i].responsive) {
+			fprintf(stderr, "autoupdater: warning: mirror %s did not answer the probe\n", states[i].url);
+			states[i].failures++;
+		}
+	}
+}
+
+static double mirror_score(const struct mirror_state *state) {
+	/* Assume average values for what hasn't been measured yet */
+	double rtt = state->rtt > 0 ? state->rtt : 1;
+	double throughput = state->throughput > 0 ? state->throughput : 1024 * 1024;
+	unsigned failures = state->failures < 8 ? state->failures : 8;
+
+	double cost = rtt + SCORE_IMAGE_SIZE / throughput;
+	return 1 / (cost * (1 << failures));
+}
+
+/** Checks whether any of the remaining mirrors has answered the probe */
+static bool any_mirror_responsive(const struct settings *s, const struct mirror_state *states) {
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		if (s->mirrors[i] && states[i].responsive)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Picks one of the remaining mirrors at random, with probabilities proportional
+ * to their scores. Mirrors that didn't answer the probe are only used when no
+ * other mirror is left.
+ */
+static size_t choose_mirror(const struct settings *s, const struct mirror_state *states) {
+	bool any_responsive = any_mirror_responsive(s, states);
+
+	double total = 0;
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		if (s->mirrors[i] && (states[i].responsive || !any_responsive))
+			total += mirror_score(&states[i]);
+	}
+
+	double r = total * random() / ((double)RAND_MAX + 1);
+	size_t chosen = 0;
+
+	for (size_t i = 0; i < s->n_mirrors; i++) {
+		if (!s->mirrors[i] || (!states[i].responsive && any_responsive))
+			continue;
+
+		chosen = i;
+
+		double score = mirror_score(&states[i]);
+		if (r < score)
+			break;
+		r -= score;
+	}
+
+	return chosen;
+}
+
+
 struct proxy_cb_priv {
 	const char *proxy_ll_addr;
 	const char *proxy_iface;
@@ -526,6 +1357,62 @@ static int proxy_image_url_cb(char *image_url, size_t url_len, const struct sett
 		 proxy_priv->proxy_ll_addr, proxy_priv->proxy_iface, s->branch, image);
 }
 
+/** Tries to update through each neighbour running a newer firmware in turn */
+static bool autoupdate_proxies(struct settings *s, struct mesh_neighbour_ctx *neigh_ctx, int lock_fd) {
+	struct updater_url_ctx proxy_download_ctx = {
+		.manifest_url_cb = proxy_manifest_url_cb,
+
+		.image_url_cb = proxy_image_url_cb,
+	};
+
+	struct mesh_neighbour *neigh;
+	size_t n_proxies = 0;
+	list_for_each_entry(neigh, &neigh_ctx->neighbours, list)
+		n_proxies++;
+
+	char v6_addrs[n_proxies][INET6_ADDRSTRLEN];
+	struct proxy_cb_priv proxies[n_proxies];
+	void *proxy_privs[n_proxies];
+
+	n_proxies = 0;
+	list_for_each_entry(neigh, &neigh_ctx->neighbours, list) {
+		char *release_str = neigh->priv;
+
+		if(!release_str) {
+			fputs("autoupdater: notice: Skipping neighbour without version info\n", stderr);
+			continue;
+		}
+
+		if(!newer_than(release_str, s->old_version)) {
+			fprintf(stderr, "autoupdater: notice: Frimware version '%s' not newer than '%s', skipping neighbour\n", release_str, s->old_version);
+			continue;
+		}
+
+		proxies[n_proxies] = (struct proxy_cb_priv){
+			.proxy_ll_addr = inet_ntop(AF_INET6, &neigh->addr, v6_addrs[n_proxies], INET6_ADDRSTRLEN),
+			.proxy_iface = neigh->iface->device,
+		};
+		n_proxies++;
+	}
+
+	for (size_t i = 0; i < n_proxies; i++) {
+		proxy_download_ctx.manifest_url_priv = proxy_download_ctx.image_url_priv = &proxies[i];
+
+		/* All other usable neighbours may serve segments of the image */
+		proxy_download_ctx.segment_url_privs = proxy_privs;
+		proxy_download_ctx.n_segment_url_privs = 0;
+		for (size_t j = 0; j < n_proxies; j++) {
+			if (j != i)
+				proxy_privs[proxy_download_ctx.n_segment_url_privs++] = &proxies[j];
+		}
+
+		if (autoupdate(s, &proxy_download_ctx, lock_fd))
+			return true;
+	}
+
+	return false;
+}
+
 int main(int argc, char *argv[]) {
 	struct settings s = { };
 	parse_args(argc, argv, &s);
@@ -551,87 +1438,92 @@ int main(int argc, char *argv[]) {
 		.image_url_cb = direct_image_url_cb,
 	};
 
+	struct direct_cb_priv segment_mirrors[s.n_mirrors];
+	void *segment_privs[s.n_mirrors];
+	direct_download_ctx.segment_url_privs = segment_privs;
+
+	struct mirror_state mirror_states[s.n_mirrors];
+	load_mirror_states(&s, mirror_states);
+	if (!external_mirrors)
+		probe_mirrors(&s, mirror_states);
+
 	size_t mirrors_left = s.n_mirrors;
 	while (mirrors_left) {
-		const char **mirror = s.mirrors;
-		size_t i = external_mirrors ? 0 : random() % mirrors_left;
+		size_t i = 0;
+		if (external_mirrors) {
+			/* Use the mirrors given on the command line in order */
+			while (!s.mirrors[i])
+				i++;
+		}
+		else {
+			i = choose_mirror(&s, mirror_states);
+		}
 
-		/* Move forward by i non-NULL entries */
-		while (true) {
-			while (!*mirror)
-				mirror++;
+		const char **mirror = &s.mirrors[i];
 
-			if (!i)
-				break;
+		struct direct_cb_priv cb_priv = { *mirror };
+		direct_download_ctx.manifest_url_priv = direct_download_ctx.image_url_priv = &cb_priv;
+		direct_download_ctx.mirror = &mirror_states[i];
 
-			mirror++;
-			i--;
+		/*
+		 The other remaining mirrors may serve segments of the image. Like in
+		 choose_mirror(), those that didn't answer the probe are left out unless
+		 none of the remaining mirrors did.
+		*/
+		bool any_responsive = any_mirror_responsive(&s, mirror_states);
+		direct_download_ctx.n_segment_url_privs = 0;
+		for (size_t j = 0; j < s.n_mirrors; j++) {
+			if (!s.mirrors[j] || &s.mirrors[j] == mirror)
+				continue;
+			if (any_responsive && !mirror_states[j].responsive)
+				continue;
+
+			size_t n = direct_download_ctx.n_segment_url_privs++;
+			segment_mirrors[n].mirror = s.mirrors[j];
+			segment_privs[n] = &segment_mirrors[n];
 		}
 
-		struct direct_cb_priv cb_priv = { *mirror };
-		direct_download_ctx.manifest_url_priv = direct_download_ctx.image_url_priv = &cb_priv;
 		if (autoupdate(&s, &direct_download_ctx, lock_fd)) {
 			// update the mtime of the lockfile to indicate a successful run
 			futimens(lock_fd, NULL);
 
+			mirror_states[i].failures = 0;
+			if (!external_mirrors)
+				save_mirror_states(&s, mirror_states);
+
 			return EXIT_SUCCESS;
 		}
 
 		/* When the update has failed, remove the mirror from the list */
+		mirror_states[i].failures++;
 		*mirror = NULL;
 		mirrors_left--;
 	}
 
+	if (!external_mirrors)
+		save_mirror_states(&s, mirror_states);
+
 	puts("autoupdater: No update severs could be reached. Trying to use mesh neighbours as proxy");
 
 	struct mesh_neighbour_ctx neigh_ctx;
+	struct mesh_neighbour *neigh;
 
 	if(mesh_get_neighbours_respondd(&neigh_ctx, 1001, respondd_mesh_cb, NULL)) {
 		fputs("autoupdater: error: Failed to get mesh neighbours\n", stderr);
 		goto fail_mesh_neigh;
 	}
 
-	struct updater_url_ctx proxy_download_ctx = {
-		.manifest_url_cb = proxy_manifest_url_cb,
-
-		.image_url_cb = proxy_image_url_cb,
-	};
-
-	struct mesh_neighbour *neigh;
-	list_for_each_entry(neigh, &neigh_ctx.neighbours, list) {
-		char *release_str = neigh->priv;
-		
-		if(!release_str) {
-			fputs("autoupdater: notice: Skipping neighbour without version info\n", stderr);
-			continue;
-		}
-
-		if(!newer_than(release_str, s.old_version)) {
-			fprintf(stderr, "autoupdater: notice: Frimware version '%s' not newer than '%s', skipping neighbour\n", release_str, s.old_version);
-			continue;			
-		}
-
-		char v6_addr_tmp[INET6_ADDRSTRLEN];
-
-		struct proxy_cb_priv proxy_priv = {
-			.proxy_ll_addr = inet_ntop(AF_INET6, &neigh->addr, v6_addr_tmp, INET6_ADDRSTRLEN),
-			.proxy_iface = neigh->iface->device,
-		};
-
-		proxy_download_ctx.manifest_url_priv = proxy_download_ctx.image_url_priv = &proxy_priv;
-
-		if (autoupdate(&s, &proxy_download_ctx, lock_fd)) {
-			// update the mtime of the lockfile to indicate a successful run
-			futimens(lock_fd, NULL);
-			list_for_each_entry(neigh, &neigh_ctx.neighbours, list) {
-				if(neigh->priv) {
-					free(neigh->priv);
-				}
+	if (autoupdate_proxies(&s, &neigh_ctx, lock_fd)) {
+		// update the mtime of the lockfile to indicate a successful run
+		futimens(lock_fd, NULL);
+		list_for_each_entry(neigh, &neigh_ctx.neighbours, list) {
+			if(neigh->priv) {
+				free(neigh->priv);
 			}
-
-			mesh_free_respondd_neighbours_ctx(&neigh_ctx);
-			return EXIT_SUCCESS;
 		}
+
+		mesh_free_respondd_neighbours_ctx(&neigh_ctx);
+		return EXIT_SUCCESS;
 	}
 
 fail_mesh_neigh:
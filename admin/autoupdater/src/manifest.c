@@ -28,10 +28,17 @@
 #include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+
+static const char *const manifest_cache_dir = "/tmp/autoupdater-cache";
 
 
 // only frees the data inside the manifest struct, not the struct itself!
@@ -152,3 +159,153 @@ void parse_line(char *line, struct manifest *m, const char *branch, const char *
 		}
 	}
 }
+
+
+/* The cache is kept in RAM to spare the flash; it only needs to survive between runs */
+static void manifest_cache_path(char *path, size_t len, const char *url) {
+	ecdsa_sha256_context_t ctx;
+	unsigned char hash[ECDSA_SHA256_HASH_SIZE];
+
+	ecdsa_sha256_init(&ctx);
+	ecdsa_sha256_update(&ctx, url, strlen(url));
+	ecdsa_sha256_final(&ctx, hash);
+
+	snprintf(path, len, "%s/%02x%02x%02x%02x%02x%02x%02x%02x", manifest_cache_dir,
+		 hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+}
+
+
+void clear_manifest_cache(struct manifest_cache *cache) {
+	free(cache->etag);
+	free(cache->last_modified);
+	free(cache->data);
+
+	memset(cache, 0, sizeof(*cache));
+}
+
+
+/**
+ * Loads the cached manifest for the given URL.
+ *
+ * The cache is only used if it has been saved with the same set of public keys
+ * and contains a validator for a conditional request. As its signature count
+ * replaces the verification, neither the directory nor the file may be
+ * writable by anyone else.
+ */
+bool load_manifest_cache(struct manifest_cache *cache, const char *url, const ecc_int256_t *keys_hash) {
+	char path[strlen(manifest_cache_dir) + 18];
+	manifest_cache_path(path, sizeof(path), url);
+
+	if (!is_trusted_dir(manifest_cache_dir))
+		return false;
+
+	FILE *f = fopen_trusted(path);
+	if (!f)
+		return false;
+
+	/* URL, hash of the public keys, number of valid signatures, ETag and Last-Modified */
+	char *lines[5] = {};
+	bool ok = false;
+
+	for (size_t i = 0; i < 5; i++) {
+		size_t n = 0;
+		ssize_t r = getline(&lines[i], &n, f);
+		if (r <= 0 || lines[i][r-1] != '\n')
+			goto out;
+
+		lines[i][r-1] = 0;
+	}
+
+	ecc_int256_t hash;
+	if (strcmp(lines[0], url) || !parsehex(hash.p, lines[1], sizeof(hash.p)) || memcmp(hash.p, keys_hash->p, sizeof(hash.p)))
+		goto out;
+
+	char *endptr;
+	cache->good_signatures = strtoul(lines[2], &endptr, 10);
+	if (*endptr || (!*lines[3] && !*lines[4]))
+		goto out;
+
+	while (true) {
+		char buf[4096];
+		size_t r = fread(buf, 1, sizeof(buf), f);
+		if (!r)
+			break;
+
+		if (cache->data_len + r > MAX_MANIFEST_CACHE_SIZE)
+			goto out;
+
+		cache->data = safe_realloc(cache->data, cache->data_len + r + 1);
+		memcpy(cache->data + cache->data_len, buf, r);
+		cache->data_len += r;
+		cache->data[cache->data_len] = 0;
+	}
+
+	if (ferror(f) || !cache->data)
+		goto out;
+
+	cache->etag = lines[3];
+	cache->last_modified = lines[4];
+	lines[3] = lines[4] = NULL;
+	ok = true;
+
+out:
+	for (size_t i = 0; i < 5; i++)
+		free(lines[i]);
+	fclose(f);
+
+	if (!ok)
+		clear_manifest_cache(cache);
+
+	return ok;
+}
+
+
+void save_manifest_cache(const struct manifest_cache *cache, const char *url, const ecc_int256_t *keys_hash) {
+	char path[strlen(manifest_cache_dir) + 18];
+	manifest_cache_path(path, sizeof(path), url);
+
+	/* Without a validator, the cache would never be used */
+	if (!cache->data || cache->data_len > MAX_MANIFEST_CACHE_SIZE || (!*cache->etag && !*cache->last_modified)) {
+		unlink(path);
+		return;
+	}
+
+	char tmp_path[sizeof(path) + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	if (mkdir(manifest_cache_dir, 0700) && errno != EEXIST)
+		goto err;
+
+	if (!is_trusted_dir(manifest_cache_dir))
+		goto err;
+
+	/* Remove a file left behind by an interrupted run */
+	unlink(tmp_path);
+
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+	if (fd < 0)
+		goto err;
+
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp_path);
+		goto err;
+	}
+
+	fprintf(f, "%s\n", url);
+	for (size_t i = 0; i < sizeof(keys_hash->p); i++)
+		fprintf(f, "%02x", keys_hash->p[i]);
+	fprintf(f, "\n%lu\n%s\n%s\n", cache->good_signatures, cache->etag, cache->last_modified);
+	fwrite(cache->data, 1, cache->data_len, f);
+
+	if (ferror(f) | fclose(f) || rename(tmp_path, path)) {
+		unlink(tmp_path);
+		goto err;
+	}
+
+	return;
+
+err:
+	fprintf(stderr, "autoupdater: warning: failed to cache manifest: %m\n");
+}
@@ -33,6 +33,10 @@
 #include <time.h>
 
 
+/* Larger manifests are not cached */
+#define MAX_MANIFEST_CACHE_SIZE (64 * 1024)
+
+
 struct manifest {
 	bool sep_found:1;
 	bool branch_ok:1;
@@ -52,6 +56,22 @@ struct manifest {
 };
 
 
+/* A manifest downloaded earlier, with the result of its signature verification */
+struct manifest_cache {
+	char *etag;
+	char *last_modified;
+	/* number of valid signatures, using the keys the cache was saved with */
+	unsigned long good_signatures;
+
+	char *data;
+	size_t data_len;
+};
+
+
 void clear_manifest(struct manifest *m);
 
+bool load_manifest_cache(struct manifest_cache *cache, const char *url, const ecc_int256_t *keys_hash);
+void save_manifest_cache(const struct manifest_cache *cache, const char *url, const ecc_int256_t *keys_hash);
+void clear_manifest_cache(struct manifest_cache *cache);
+
 void parse_line(char *line, struct manifest *m, const char *branch, const char *image_name);
@@ -149,6 +149,13 @@ void load_settings(struct settings *settings) {
 		exit(1);
 	}
 
+	if (!settings->segments) {
+		if (uci_lookup_option_string(ctx, s, "segments"))
+			settings->segments = load_positive_number(ctx, s, "segments");
+		else
+			settings->segments = 1;
+	}
+
 	struct uci_section *branch = uci_lookup_section(ctx, p, settings->branch);
 	if (!branch || strcmp(branch->type, "branch")) {
 		fprintf(stderr, "autoupdater: error: unable to load branch configuration for branch '%s'\n", settings->branch);
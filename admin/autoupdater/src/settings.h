@@ -36,6 +36,7 @@ struct settings {
 	bool force_version;
 	const char *branch;
 	unsigned long good_signatures;
+	unsigned long segments;
 	char *old_version;
 
 	size_t n_mirrors;
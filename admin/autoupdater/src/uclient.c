@@ -31,6 +31,7 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 
 
 #define TIMEOUT_MSEC 300000
@@ -42,6 +43,8 @@ enum uclient_own_error_code {
 	UCLIENT_ERROR_TOO_MANY_REDIRECTS,
 	UCLIENT_ERROR_CONNECTION_RESET_PREMATURELY,
 	UCLIENT_ERROR_SIZE_MISMATCH,
+	UCLIENT_ERROR_RANGE_MISMATCH,
+	UCLIENT_ERROR_ABORTED,
 	UCLIENT_ERROR_STATUS_CODE = 1024,
 };
 
@@ -66,6 +69,10 @@ const char *uclient_get_errmsg(int code) {
 		return "Connection reset prematurely";
 	case UCLIENT_ERROR_SIZE_MISMATCH:
 		return "Incorrect file size";
+	case UCLIENT_ERROR_RANGE_MISMATCH:
+		return "Incorrect range returned";
+	case UCLIENT_ERROR_ABORTED:
+		return "Download aborted";
 	default:
 		return "Unknown error";
 	}
@@ -73,18 +80,57 @@ const char *uclient_get_errmsg(int code) {
 
 
 static void request_done(struct uclient *cl, int err_code) {
-	uclient_data(cl)->err_code = err_code;
+	struct uclient_data *d = uclient_data(cl);
+
+	d->err_code = err_code;
 	uclient_disconnect(cl);
-	uloop_end();
+
+	if (d->done_cb)
+		d->done_cb(cl);
+	else
+		uloop_end();
+}
+
+
+static void copy_header(char *buf, size_t size, struct blob_attr *attr) {
+	const char *value = attr ? blobmsg_get_string(attr) : "";
+
+	if (strlen(value) < size)
+		strcpy(buf, value);
+	else
+		*buf = 0;
 }
 
 
 static void header_done_cb(struct uclient *cl) {
-	const struct blobmsg_policy policy = {
-		.name = "content-length",
-		.type = BLOBMSG_TYPE_STRING,
+	enum {
+		HEADER_CONTENT_LENGTH,
+		HEADER_CONTENT_RANGE,
+		HEADER_ETAG,
+		HEADER_LAST_MODIFIED,
+		__HEADER_MAX,
+	};
+	const struct blobmsg_policy policy[__HEADER_MAX] = {
+		[HEADER_CONTENT_LENGTH] = {
+			.name = "content-length",
+			.type = BLOBMSG_TYPE_STRING,
+		},
+		[HEADER_CONTENT_RANGE] = {
+			.name = "content-range",
+			.type = BLOBMSG_TYPE_STRING,
+		},
+		[HEADER_ETAG] = {
+			.name = "etag",
+			.type = BLOBMSG_TYPE_STRING,
+		},
+		[HEADER_LAST_MODIFIED] = {
+			.name = "last-modified",
+			.type = BLOBMSG_TYPE_STRING,
+		},
 	};
-	struct blob_attr *tb_len;
+	struct blob_attr *tb[__HEADER_MAX];
+	struct uclient_data *d = uclient_data(cl);
+	ssize_t expected_len = d->length;
 
 	if (uclient_data(cl)->retries < 10) {
 		int ret = uclient_http_redirect(cl);
@@ -98,9 +144,44 @@ static void header_done_cb(struct uclient *cl) {
 		}
 	}
 
+	blobmsg_parse(policy, __HEADER_MAX, tb, blob_data(cl->meta), blob_len(cl->meta));
+
 	switch (cl->status_code) {
 	case 200:
+		/* The server has ignored our Range header, the data we already have will be skipped */
+		d->downloaded = 0;
+
+		copy_header(d->etag, sizeof(d->etag), tb[HEADER_ETAG]);
+		copy_header(d->last_modified, sizeof(d->last_modified), tb[HEADER_LAST_MODIFIED]);
+		break;
+	case 206:
+		if (!d->range || !tb[HEADER_CONTENT_RANGE]) {
+			request_done(cl, UCLIENT_ERROR_STATUS_CODE | cl->status_code);
+			return;
+		}
+
+		/* Only exactly the requested range is acceptable */
+		unsigned long long start, end;
+		if (sscanf(blobmsg_get_string(tb[HEADER_CONTENT_RANGE]), "bytes %llu-%llu", &start, &end) != 2
+				|| start != (unsigned long long)d->offset
+				|| (d->length >= 0 && end != (unsigned long long)d->length - 1)) {
+			request_done(cl, UCLIENT_ERROR_RANGE_MISMATCH);
+			return;
+		}
+
+		d->downloaded = d->offset;
+		if (expected_len >= 0)
+			expected_len -= d->offset;
 		break;
+	case 304:
+		if (!d->if_none_match && !d->if_modified_since) {
+			request_done(cl, UCLIENT_ERROR_STATUS_CODE | cl->status_code);
+			return;
+		}
+
+		d->not_modified = true;
+		request_done(cl, 0);
+		return;
 	case 301:
 	case 302:
 	case 307:
@@ -111,26 +192,44 @@ static void header_done_cb(struct uclient *cl) {
 		return;
 	}
 
-	blobmsg_parse(&policy, 1, &tb_len, blob_data(cl->meta), blob_len(cl->meta));
-	if (tb_len) {
+	if (d->head) {
+		request_done(cl, 0);
+		return;
+	}
+
+	if (tb[HEADER_CONTENT_LENGTH]) {
 		char *endptr;
 
 		errno = 0;
-		unsigned long long val = strtoull(blobmsg_get_string(tb_len), &endptr, 10);
+		unsigned long long val = strtoull(blobmsg_get_string(tb[HEADER_CONTENT_LENGTH]), &endptr, 10);
 		if (!errno && !*endptr && val <= SSIZE_MAX) {
-			if (uclient_data(cl)->length >= 0 && uclient_data(cl)->length != (ssize_t)val) {
+			if (expected_len >= 0 && expected_len != (ssize_t)val) {
 				request_done(cl, UCLIENT_ERROR_SIZE_MISMATCH);
 				return;
 			}
 
-			uclient_data(cl)->length = val;
+			if (d->length < 0)
+				d->length = d->downloaded + val;
 		}
 	}
 }
 
 
 static void eof_cb(struct uclient *cl) {
-	request_done(cl, cl->data_eof ? 0 : UCLIENT_ERROR_CONNECTION_RESET_PREMATURELY);
+	struct uclient_data *d = uclient_data(cl);
+
+	if (!cl->data_eof)
+		request_done(cl, UCLIENT_ERROR_CONNECTION_RESET_PREMATURELY);
+	else if (d->length >= 0 && d->downloaded != d->length)
+		request_done(cl, UCLIENT_ERROR_SIZE_MISMATCH);
+	else
+		request_done(cl, 0);
+}
+
+
+/** Ends a request from a uclient callback, e.g. when the received data can't be stored */
+void abort_url(struct uclient *cl) {
+	request_done(cl, UCLIENT_ERROR_ABORTED);
 }
 
 
@@ -138,6 +237,20 @@ ssize_t uclient_read_account(struct uclient *cl, char *buf, int len) {
 	struct uclient_data *d = uclient_data(cl);
 	int r = uclient_read(cl, buf, len);
 
+	/* Skip data the caller already has if the server has sent the whole file */
+	while (r > 0 && d->downloaded < d->offset) {
+		int skip = r;
+		if (skip > d->offset - d->downloaded)
+			skip = d->offset - d->downloaded;
+
+		d->downloaded += skip;
+		r -= skip;
+		memmove(buf, buf + skip, r);
+
+		if (!r)
+			r = uclient_read(cl, buf, len);
+	}
+
 	if (r >= 0) {
 		d->downloaded += r;
 
@@ -151,43 +264,89 @@ ssize_t uclient_read_account(struct uclient *cl, char *buf, int len) {
 }
 
 
-int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t len) {
-	struct uclient_data d = { .custom = cb_data, .length = len };
-	struct uclient_cb cb = {
+/**
+ * Starts a request without running the event loop.
+ *
+ * The caller has to fill in d, which must stay valid until the request is
+ * finished; d->done_cb is called then. The client is freed by \ref finish_url,
+ * which must not be called from a uclient callback.
+ */
+struct uclient * start_url(const char *url, void (*read_cb)(struct uclient *cl), struct uclient_data *d) {
+	d->cb = (struct uclient_cb){
 		.header_done = header_done_cb,
 		.data_read = read_cb,
 		.data_eof = eof_cb,
 		.error = request_done,
 	};
+	d->downloaded = d->offset;
 
-	struct uclient *cl = uclient_new(url, NULL, &cb);
+	struct uclient *cl = uclient_new(url, NULL, &d->cb);
 	if (!cl)
 		goto err;
 
-	cl->priv = &d;
-	if (uclient_set_timeout(cl, TIMEOUT_MSEC))
+	cl->priv = d;
+	if (uclient_set_timeout(cl, d->timeout ? d->timeout : TIMEOUT_MSEC))
 		goto err;
 	if (uclient_connect(cl))
 		goto err;
-	if (uclient_http_set_request_type(cl, "GET"))
+	if (uclient_http_set_request_type(cl, d->head ? "HEAD" : "GET"))
 		goto err;
 	if (uclient_http_reset_headers(cl))
 		goto err;
 	if (uclient_http_set_header(cl, "User-Agent", user_agent))
 		goto err;
+	if (d->if_none_match && uclient_http_set_header(cl, "If-None-Match", d->if_none_match))
+		goto err;
+	if (d->if_modified_since && uclient_http_set_header(cl, "If-Modified-Since", d->if_modified_since))
+		goto err;
+	if (d->range) {
+		char range[48];
+		if (d->length >= 0)
+			snprintf(range, sizeof(range), "bytes=%zd-%zd", d->offset, d->length - 1);
+		else
+			snprintf(range, sizeof(range), "bytes=%zd-", d->offset);
+		if (uclient_http_set_header(cl, "Range", range))
+			goto err;
+	}
 	if (uclient_request(cl))
 		goto err;
-	uloop_run();
-	uclient_free(cl);
-
-	if (!d.err_code && d.length >= 0 && d.downloaded != d.length)
-		return UCLIENT_ERROR_SIZE_MISMATCH;
 
-	return d.err_code;
+	return cl;
 
 err:
 	if (cl)
 		uclient_free(cl);
 
-	return UCLIENT_ERROR_CONNECT;
+	return NULL;
+}
+
+
+int finish_url(struct uclient *cl) {
+	struct uclient_data *d = uclient_data(cl);
+	uclient_free(cl);
+
+	/* The loop may have been left before the request was finished */
+	if (!d->err_code && d->length >= 0 && d->downloaded != d->length)
+		return UCLIENT_ERROR_SIZE_MISMATCH;
+
+	return d->err_code;
+}
+
+
+/** Runs a request set up like for \ref start_url until it is finished */
+int run_url(const char *url, void (*read_cb)(struct uclient *cl), struct uclient_data *d) {
+	struct uclient *cl = start_url(url, read_cb, d);
+	if (!cl)
+		return UCLIENT_ERROR_CONNECT;
+
+	uloop_run();
+
+	return finish_url(cl);
+}
+
+
+int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t len, ssize_t offset) {
+	struct uclient_data d = { .custom = cb_data, .length = len, .offset = offset, .range = offset > 0 };
+
+	return run_url(url, read_cb, &d);
 }
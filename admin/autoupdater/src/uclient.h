@@ -26,17 +26,38 @@
 
 
 #include <libubox/uclient.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 
 struct uclient_data {
 	/* data that can be passed in by caller and used in custom callbacks */
 	void *custom;
+	/* called when a request started by start_url() has finished */
+	void (*done_cb)(struct uclient *cl);
 	/* data used by uclient callbacks */
 	int retries;
 	int err_code;
 	ssize_t downloaded;
 	ssize_t length;
+	/* number of bytes the caller already has; data before it is not passed on */
+	ssize_t offset;
+	/* request only the bytes from offset up to length, even when offset is 0 */
+	bool range;
+	/* only request the headers; the request is finished when they have been received */
+	bool head;
+	/* inactivity timeout in milliseconds, 0 for the default */
+	int timeout;
+	/* validators for a conditional request, NULL if not used */
+	const char *if_none_match;
+	const char *if_modified_since;
+	/* set when the server has answered a conditional request with 304 Not Modified */
+	bool not_modified;
+	/* validators sent by the server; empty if missing or too long */
+	char etag[128];
+	char last_modified[64];
+
+	struct uclient_cb cb;
 };
 
 inline struct uclient_data * uclient_data(struct uclient *cl) {
@@ -50,5 +71,9 @@ inline void * uclient_get_custom(struct uclient *cl) {
 
 ssize_t uclient_read_account(struct uclient *cl, char *buf, int len);
 
-int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t len);
+int get_url(const char *url, void (*read_cb)(struct uclient *cl), void *cb_data, ssize_t len, ssize_t offset);
+struct uclient * start_url(const char *url, void (*read_cb)(struct uclient *cl), struct uclient_data *d);
+int finish_url(struct uclient *cl);
+int run_url(const char *url, void (*read_cb)(struct uclient *cl), struct uclient_data *d);
+void abort_url(struct uclient *cl);
 const char *uclient_get_errmsg(int code);
@@ -32,8 +32,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 
@@ -101,6 +103,58 @@ float get_uptime(void) {
 	exit(1);
 }
 
+double get_monotonic_time(void) {
+	struct timespec tv;
+	if (clock_gettime(CLOCK_MONOTONIC, &tv)) {
+		perror("autoupdater: error: clock_gettime");
+		exit(1);
+	}
+
+	return tv.tv_sec + tv.tv_nsec / 1e9;
+}
+
+/* Files in world-writable locations are only trusted if nobody else can have written them */
+static bool is_trusted(const struct stat *st) {
+	return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP|S_IWOTH));
+}
+
+bool is_trusted_dir(const char *path) {
+	struct stat st;
+	if (lstat(path, &st))
+		return false;
+
+	if (!S_ISDIR(st.st_mode) || !is_trusted(&st)) {
+		errno = EPERM;
+		return false;
+	}
+
+	return true;
+}
+
+/* Opens a regular file for reading, refusing symlinks and files that may have been written by others */
+FILE * fopen_trusted(const char *path) {
+	int fd = open(path, O_RDONLY|O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st))
+		goto err;
+
+	if (!S_ISREG(st.st_mode) || !is_trusted(&st)) {
+		errno = EPERM;
+		goto err;
+	}
+
+	FILE *f = fdopen(fd, "r");
+	if (f)
+		return f;
+
+err:
+	close(fd);
+	return NULL;
+}
+
 void * safe_malloc(size_t size) {
 	void *ret = malloc(size);
 	if (!ret) {
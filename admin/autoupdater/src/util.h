@@ -24,12 +24,18 @@
 */
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 
 void run_dir(const char *dir);
 void randomize(void);
 float get_uptime(void);
+double get_monotonic_time(void);
+
+bool is_trusted_dir(const char *path);
+FILE * fopen_trusted(const char *path);
 
 void * safe_malloc(size_t size);
 void * safe_realloc(void *ptr, size_t size);
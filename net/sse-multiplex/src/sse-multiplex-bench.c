@@ -0,0 +1,477 @@
+/*
+  Copyright (c) 2015-2018, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+        Throughput and latency benchmark for sse-multiplexd
+
+        The daemon is started on a temporary socket. Synthetic providers
+        (this program, run in provider mode) emit events of a configurable
+        size at a configurable rate, each carrying the time it was generated.
+        A number of simulated sse-multiplex clients are attached to every
+        provider; after a warm-up period, the delivered events, their latency
+        and the CPU time used by the daemon are measured.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+
+#define WARMUP_MS 1000
+
+
+typedef struct {
+        int fd;
+
+        char *buf;
+        size_t buflen;
+        size_t len;
+        bool header;
+
+        uint32_t *samples;
+        size_t n_samples;
+        size_t samples_size;
+} client_t;
+
+
+static const char *daemon_path = "./sse-multiplexd";
+static unsigned n_providers = 1;
+static unsigned n_clients = 10;
+static size_t event_size = 256;
+static unsigned event_rate = 100;
+static unsigned duration = 10;
+
+static char **daemon_args = NULL;
+static int n_daemon_args = 0;
+
+
+static uint64_t now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void __attribute__((noreturn)) exit_errno(const char *message) {
+        fprintf(stderr, "sse-multiplex-bench: %s: %s\n", message, strerror(errno));
+        exit(1);
+}
+
+/**
+        Provider mode: writes a header followed by events of the given size
+        at the given rate to stdout
+
+        Each event starts with the time it was generated and a sequence number
+        and is padded to the requested size.
+*/
+static int run_provider(size_t size, unsigned rate) {
+        static const char header[] = "Content-Type: text/event-stream\n\n";
+        if (fwrite(header, sizeof(header)-1, 1, stdout) != 1)
+                return 1;
+        fflush(stdout);
+
+        char event[size+64];
+        uint64_t interval = 1000000000 / (rate ? rate : 1);
+        uint64_t next = now_ns();
+
+        for (uint64_t seq = 0;; seq++) {
+                int len = snprintf(event, sizeof(event), "data: %" PRIu64 " %" PRIu64 " ", now_ns(), seq);
+
+                while ((size_t)len + 2 < size)
+                        event[len++] = 'x';
+
+                event[len++] = '\n';
+                event[len++] = '\n';
+
+                if (fwrite(event, len, 1, stdout) != 1 || fflush(stdout))
+                        return 0;
+
+                next += interval;
+                struct timespec ts = { .tv_sec = next / 1000000000, .tv_nsec = next % 1000000000 };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+}
+
+static pid_t start_daemon(const char *socket_path) {
+        char *argv[n_daemon_args + 6];
+        int argc = 0;
+
+        argv[argc++] = (char *)daemon_path;
+        argv[argc++] = "-s";
+        argv[argc++] = (char *)socket_path;
+        for (int i = 0; i < n_daemon_args; i++)
+                argv[argc++] = daemon_args[i];
+        argv[argc] = NULL;
+
+        pid_t pid = fork();
+        if (pid < 0)
+                exit_errno("fork");
+
+        if (pid == 0) {
+                execv(daemon_path, argv);
+                fprintf(stderr, "sse-multiplex-bench: unable to run `%s': %s\n", daemon_path, strerror(errno));
+                _exit(127);
+        }
+
+        return pid;
+}
+
+static int connect_client(const char *socket_path, const char *command) {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        strncpy(sa.sun_path, socket_path, sizeof(sa.sun_path)-1);
+
+        for (int retry = 0; retry < 200; retry++) {
+                int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                        exit_errno("socket");
+
+                if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+                        size_t len = strlen(command);
+                        if (write(fd, command, len) != (ssize_t)len)
+                                exit_errno("write");
+                        if (shutdown(fd, SHUT_WR) < 0)
+                                exit_errno("shutdown");
+
+                        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                        return fd;
+                }
+
+                /* The daemon might not be listening yet */
+                close(fd);
+                usleep(10000);
+        }
+
+        exit_errno("connect");
+}
+
+/** Returns the CPU time used by a process so far in microseconds */
+static uint64_t process_cpu_us(pid_t pid) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%i/stat", (int)pid);
+
+        FILE *f = fopen(path, "r");
+        if (!f)
+                return 0;
+
+        char buf[1024];
+        size_t len = fread(buf, 1, sizeof(buf)-1, f);
+        fclose(f);
+        buf[len] = 0;
+
+        /* The command name may contain spaces, so start after its closing paren */
+        char *p = strrchr(buf, ')');
+        if (!p)
+                return 0;
+
+        unsigned long utime, stime;
+        if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+                return 0;
+
+        return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void client_sample(client_t *c, uint32_t latency) {
+        if (c->n_samples == c->samples_size) {
+                c->samples_size = c->samples_size ? 2*c->samples_size : 1024;
+                c->samples = realloc(c->samples, c->samples_size * sizeof(*c->samples));
+        }
+
+        c->samples[c->n_samples++] = latency;
+}
+
+/**
+        Reads from a client socket and records the latency of every complete
+        event generated after the start of the measurement
+*/
+static bool client_read(client_t *c, uint64_t start) {
+        while (true) {
+                if (c->buflen - c->len < 4096) {
+                        c->buflen = c->buflen ? 2*c->buflen : 16384;
+                        c->buf = realloc(c->buf, c->buflen);
+                }
+
+                ssize_t r = read(c->fd, c->buf + c->len, c->buflen - c->len);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                break;
+
+                        return false;
+                }
+
+                if (r == 0)
+                        return false;
+
+                c->len += r;
+        }
+
+        uint64_t now = now_ns();
+        char *pos = c->buf, *end = c->buf + c->len;
+
+        while (pos < end) {
+                char *sep = memmem(pos, end - pos, "\n\n", 2);
+                if (!sep)
+                        break;
+
+                uint64_t ts;
+                if (!c->header)
+                        c->header = true;
+                else if (sscanf(pos, "data: %" SCNu64, &ts) == 1 && ts >= start)
+                        client_sample(c, (now - ts) / 1000);
+
+                pos = sep + 2;
+        }
+
+        memmove(c->buf, pos, end - pos);
+        c->len = end - pos;
+
+        return true;
+}
+
+static int compare_u32(const void *a, const void *b) {
+        uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+        return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *samples, size_t n, unsigned p) {
+        if (!n)
+                return 0;
+
+        return samples[(n - 1) * p / 100];
+}
+
+static void usage(void) {
+        fprintf(stderr,
+                "Usage: sse-multiplex-bench [-h] [-d <daemon>] [-p <providers>] [-c <clients per provider>]\n"
+                "                           [-s <event size>] [-r <events per second>] [-t <seconds>]\n"
+                "                           [-- <daemon arguments>]\n");
+}
+
+static unsigned long parse_number(const char *arg, unsigned long max) {
+        char *endptr;
+        unsigned long val = strtoul(arg, &endptr, 0);
+
+        if (!*arg || *endptr || !val || val > max) {
+                fprintf(stderr, "sse-multiplex-bench: invalid number `%s'\n", arg);
+                exit(1);
+        }
+
+        return val;
+}
+
+static void parse_cmdline(int argc, char *argv[]) {
+        int c;
+
+        while ((c = getopt(argc, argv, "d:p:c:s:r:t:h")) != -1) {
+                switch (c) {
+                case 'd':
+                        daemon_path = optarg;
+                        break;
+
+                case 'p':
+                        n_providers = parse_number(optarg, 1024);
+                        break;
+
+                case 'c':
+                        n_clients = parse_number(optarg, 65536);
+                        break;
+
+                case 's':
+                        event_size = parse_number(optarg, 65536);
+                        break;
+
+                case 'r':
+                        event_rate = parse_number(optarg, 1000000);
+                        break;
+
+                case 't':
+                        duration = parse_number(optarg, 86400);
+                        break;
+
+                case 'h':
+                        usage();
+                        exit(0);
+
+                default:
+                        usage();
+                        exit(1);
+                }
+        }
+
+        daemon_args = argv + optind;
+        n_daemon_args = argc - optind;
+}
+
+int main(int argc, char *argv[]) {
+        if (argc == 4 && !strcmp(argv[1], "--provider"))
+                return run_provider(strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0));
+
+        parse_cmdline(argc, argv);
+
+        signal(SIGPIPE, SIG_IGN);
+
+        char self[PATH_MAX];
+        ssize_t self_len = readlink("/proc/self/exe", self, sizeof(self)-1);
+        if (self_len < 0)
+                exit_errno("readlink");
+        self[self_len] = 0;
+
+        char dir[] = "/tmp/sse-multiplex-bench.XXXXXX";
+        if (!mkdtemp(dir))
+                exit_errno("mkdtemp");
+
+        char socket_path[sizeof(dir) + 5];
+        snprintf(socket_path, sizeof(socket_path), "%s/sock", dir);
+
+        pid_t daemon_pid = start_daemon(socket_path);
+
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+                exit_errno("epoll_create1");
+
+        size_t n_total = (size_t)n_providers * n_clients;
+        client_t *clients = calloc(n_total, sizeof(*clients));
+
+        for (unsigned i = 0; i < n_providers; i++) {
+                /* The provider index makes the commands distinct */
+                char command[PATH_MAX + 64];
+                snprintf(command, sizeof(command), "exec '%s' --provider %zu %u # %u", self, event_size, event_rate, i);
+
+                for (unsigned j = 0; j < n_clients; j++) {
+                        client_t *c = &clients[i*n_clients + j];
+                        c->fd = connect_client(socket_path, command);
+
+                        struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+                        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event) < 0)
+                                exit_errno("epoll_ctl");
+                }
+        }
+
+        uint64_t start = now_ns() + (uint64_t)WARMUP_MS * 1000000;
+        uint64_t end = start + (uint64_t)duration * 1000000000;
+        uint64_t cpu_start = 0;
+        bool measuring = false;
+        size_t disconnected = 0;
+
+        while (true) {
+                uint64_t now = now_ns();
+
+                if (!measuring && now >= start) {
+                        cpu_start = process_cpu_us(daemon_pid);
+                        measuring = true;
+                }
+
+                if (now >= end)
+                        break;
+
+                uint64_t next = measuring ? end : start;
+                struct epoll_event events[64];
+                int n = epoll_wait(epoll_fd, events, 64, (next - now) / 1000000 + 1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        exit_errno("epoll_wait");
+                }
+
+                for (int i = 0; i < n; i++) {
+                        client_t *c = events[i].data.ptr;
+
+                        if (!client_read(c, start)) {
+                                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+                                close(c->fd);
+                                c->fd = -1;
+                                disconnected++;
+                        }
+                }
+        }
+
+        uint64_t cpu_used = process_cpu_us(daemon_pid) - cpu_start;
+
+        kill(daemon_pid, SIGTERM);
+        waitpid(daemon_pid, NULL, 0);
+        unlink(socket_path);
+        rmdir(dir);
+
+        size_t n_samples = 0;
+        for (size_t i = 0; i < n_total; i++)
+                n_samples += clients[i].n_samples;
+
+        uint32_t *all = malloc((n_samples ? n_samples : 1) * sizeof(*all));
+        uint32_t worst_p99 = 0;
+        size_t pos = 0;
+
+        for (size_t i = 0; i < n_total; i++) {
+                client_t *c = &clients[i];
+
+                qsort(c->samples, c->n_samples, sizeof(*c->samples), compare_u32);
+
+                uint32_t p99 = percentile(c->samples, c->n_samples, 99);
+                if (p99 > worst_p99)
+                        worst_p99 = p99;
+
+                memcpy(all + pos, c->samples, c->n_samples * sizeof(*all));
+                pos += c->n_samples;
+        }
+
+        qsort(all, n_samples, sizeof(*all), compare_u32);
+
+        double expected = (double)n_total * event_rate * duration;
+
+        printf("providers:            %u\n", n_providers);
+        printf("clients per provider: %u\n", n_clients);
+        printf("event size:           %zu bytes\n", event_size);
+        printf("event rate:           %u/s per provider\n", event_rate);
+        printf("duration:             %u s\n", duration);
+        printf("\n");
+        printf("delivered events:     %zu (%.1f%% of expected)\n", n_samples, expected ? 100.0 * n_samples / expected : 0.0);
+        printf("delivered events/s:   %.1f\n", (double)n_samples / duration);
+        printf("disconnected clients: %zu\n", disconnected);
+        printf("latency (us):         p50 %" PRIu32 ", p90 %" PRIu32 ", p99 %" PRIu32 ", max %" PRIu32 "\n",
+               percentile(all, n_samples, 50), percentile(all, n_samples, 90),
+               percentile(all, n_samples, 99), percentile(all, n_samples, 100));
+        printf("worst client p99 (us): %" PRIu32 "\n", worst_p99);
+        printf("daemon CPU time:      %.3f s (%.2f us per delivered event)\n",
+               cpu_used / 1e6, n_samples ? (double)cpu_used / n_samples : 0.0);
+
+        return 0;
+}
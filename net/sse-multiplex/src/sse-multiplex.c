@@ -27,6 +27,8 @@
 #include <generated/sse-multiplex.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -34,12 +36,169 @@
 #include <unistd.h>
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 
+#define RELAY_BUFSIZE 65536
+
+
+/** Writes a whole buffer to a FD, retrying on partial writes */
+static bool feed(int fd, const char *buffer, size_t len) {
+	while (len) {
+		ssize_t w = write(fd, buffer, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		buffer += w;
+		len -= w;
+	}
+
+	return true;
+}
+
+/**
+	Sends the request to the daemon
+
+	In multi-channel mode (-m), the request consists of a NUL byte followed
+	by NUL-terminated pairs of event names and commands, taken from
+	<event>=<command> arguments.
+*/
+static bool send_request(int fd, int argc, char *argv[]) {
+	if (argc == 2)
+		return feed(fd, argv[1], strlen(argv[1]));
+
+	if (!feed(fd, "", 1))
+		return false;
+
+	for (int i = 2; i < argc; i++) {
+		char *sep = strchr(argv[i], '=');
+		size_t name_len = sep - argv[i];
+
+		if (!feed(fd, argv[i], name_len) || !feed(fd, "", 1))
+			return false;
+		if (!feed(fd, sep+1, strlen(sep+1)+1))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+	Moves the data from the socket to stdout without copying it to
+	userspace
+
+	This only works when stdout is a pipe (which it is when we are run as
+	CGI by uhttpd). Returns -1 if splicing is not possible at all, so the
+	caller can fall back to relay_buffered().
+*/
+static int relay_splice(int fd) {
+	struct stat st;
+	if (fstat(STDOUT_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode))
+		return -1;
+
+	bool spliced = false;
+
+	while (true) {
+		ssize_t r = splice(fd, NULL, STDOUT_FILENO, NULL, RELAY_BUFSIZE, SPLICE_F_MOVE);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (!spliced && errno == EINVAL)
+				return -1;
+
+			fprintf(stderr, "splice: %s\n", strerror(errno));
+			return 1;
+		}
+
+		if (r == 0)
+			return 0;
+
+		spliced = true;
+	}
+}
+
+/**
+	Copies the data from the socket to stdout, writing only complete SSE
+	records (unless a single record doesn't fit into the buffer), so there
+	is a single write per batch of records
+*/
+static int relay_buffered(int fd) {
+	static char buf[RELAY_BUFSIZE];
+	size_t len = 0;
+
+	while (true) {
+		ssize_t r = recv(fd, buf + len, sizeof(buf) - len, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "read: %s\n", strerror(errno));
+			return 1;
+		}
+
+		if (r == 0)
+			return feed(STDOUT_FILENO, buf, len) ? 0 : 1;
+
+		size_t old_len = len;
+		len += r;
+
+		/*
+			Find the end of the last complete record; it must be in
+			the new data, as all complete records have been written
+			before
+		*/
+		size_t end = len;
+		while (end > old_len && end >= 2 && !(buf[end-1] == '\n' && buf[end-2] == '\n'))
+			end--;
+
+		if (end <= old_len || end < 2) {
+			if (len < sizeof(buf))
+				continue;
+
+			end = len;
+		}
+
+		if (!feed(STDOUT_FILENO, buf, end))
+			return 1;
+
+		memmove(buf, buf + end, len - end);
+		len -= end;
+	}
+}
+
+static void usage(const char *cmd) {
+	fprintf(stderr, "Usage: %s <command>\n", cmd);
+	fprintf(stderr, "       %s -m <event>=<command> [<event>=<command> ...]\n", cmd);
+}
+
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <command>\n", argv[0]);
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "-m")) {
+		if (argc < 3) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		for (int i = 2; i < argc; i++) {
+			char *sep = strchr(argv[i], '=');
+			if (!sep || sep == argv[i] || !sep[1]) {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+	}
+	else if (argc != 2) {
+		usage(argv[0]);
 		return 1;
 	}
 
@@ -64,15 +223,9 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	char *command = argv[1];
-	while (command[0]) {
-		ssize_t w = write(fd, command, strlen(command));
-		if (w < 0) {
-			fprintf(stderr, "Can't write command: %s\n", strerror(errno));
-			return 1;
-		}
-
-		command += w;
+	if (!send_request(fd, argc, argv)) {
+		fprintf(stderr, "Can't write command: %s\n", strerror(errno));
+		return 1;
 	}
 
 	if (shutdown(fd, SHUT_WR) < 0) {
@@ -80,20 +233,9 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	setlinebuf(stdout);
+	int ret = relay_splice(fd);
+	if (ret < 0)
+		ret = relay_buffered(fd);
 
-	char buf[1024];
-	ssize_t r;
-	while (1) {
-		r = recv(fd, buf, sizeof(buf), 0);
-		if (r < 0) {
-			fprintf(stderr, "read: %s\n", strerror(errno));
-			return 1;
-		}
-
-		if (r == 0)
-			return 0;
-
-		fwrite(buf, r, 1, stdout);
-	}
+	return ret;
 }
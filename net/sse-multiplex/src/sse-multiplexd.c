@@ -28,6 +28,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -36,62 +38,181 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 
+typedef struct event event_t;
 typedef struct client client_t;
 typedef struct provider provider_t;
+typedef struct subscription subscription_t;
 
-typedef void (*handler_t)(provider_t *, void *buffer, size_t len);
+
+typedef enum {
+        OVERFLOW_DROP = 0,
+        OVERFLOW_DISCONNECT,
+} overflow_policy_t;
+
+
+/* Records longer than this are dropped */
+#define MAX_RECORD_LEN 65536
+
+/* Maximum number of events written by a single writev() */
+#define MAX_IOV 16
+
+/* Maximum length of a request sent by a client */
+#define MAX_REQUEST_LEN 4095
+
+/* Maximum number of channels of a multi-channel request */
+#define MAX_CHANNELS 32
+
+/* Initial number of buckets of the provider hash table */
+#define MIN_PROVIDER_BUCKETS 16
 
 
 static volatile bool running = true;
 
+static const char *socket_path = SSE_MULTIPLEX_SOCKET;
+
 static int epoll_fd = -1;
 static int listen_fd = -1;
 static struct epoll_event listen_event = {};
 
-static provider_t *providers = NULL;
+/* Hash table of all providers, indexed by command */
+static provider_t **providers = NULL;
+static size_t provider_buckets = 0;
+static size_t provider_count = 0;
+
+/*
+        Providers without clients, ordered by the time they became idle (and
+        thus by their expiry time, as the linger time is the same for all)
+*/
+static provider_t *idle_head = NULL;
+static provider_t *idle_tail = NULL;
+
+/* Clients still sending their command, ordered by their deadline */
+static client_t *pending_head = NULL;
+static client_t *pending_tail = NULL;
+
+static size_t queue_size = 65536;
+static overflow_policy_t overflow_policy = OVERFLOW_DROP;
+static size_t replay_count = 1;
+static unsigned linger_time = 5000;
+static unsigned command_timeout = 5000;
+static int listen_backlog = 16;
+
+/* Header sent to multi-channel clients */
+static event_t *multi_header = NULL;
 
 
 typedef enum {
-        CLIENT_STATE_NEW = 0,
-        CLIENT_STATE_HEADER_SENT,
-        CLIENT_STATE_ACTIVE,
+        HANDLE_TYPE_PROVIDER = 0,
+        HANDLE_TYPE_CLIENT,
+} handle_type_t;
+
+typedef enum {
+        CLIENT_STATE_COMMAND = 0,
+        CLIENT_STATE_OPEN,
         CLIENT_STATE_CLOSE,
 } client_state_t;
 
 
+/**
+        A complete SSE record (or the header) read from a provider
+
+        Events are shared by all clients of a provider and freed when
+        the last reference is dropped.
+*/
+struct event {
+        size_t refcount;
+        size_t len;
+        char data[];
+};
+
 struct client {
-        struct client *next;
+        handle_type_t type;
+        subscription_t *subscriptions;
 
         int fd;
         client_state_t state;
+        struct epoll_event event;
+
+        /* Only used while the command is being received */
+        struct client *pending_prev;
+        struct client *pending_next;
+        uint64_t deadline;
+        char *command;
+        size_t command_len;
+
+        /*
+                Output queue: a ring buffer of event references. queue_offset
+                is the number of bytes of the first event that have already
+                been written, queue_len the number of bytes still to write.
+        */
+        event_t **queue;
+        size_t queue_slots;
+        size_t queue_head;
+        size_t queue_count;
+        size_t queue_offset;
+        size_t queue_len;
 };
 
 struct provider {
+        handle_type_t type;
+
         struct provider *prev;
         struct provider *next;
 
+        struct provider *idle_prev;
+        struct provider *idle_next;
+        bool idle;
+        uint64_t idle_expiry;
+
+        uint32_t hash;
         char *command;
         int fd;
         struct epoll_event event;
 
-        size_t header_buflen;
-        size_t header_len;
-        char *header;
+        event_t *header;
+
+        /* The record currently being assembled */
+        event_t *record;
+        size_t record_buflen;
+        bool newline;
+        bool discard;
+
+        /* Ring buffer of the last replay_count records */
+        event_t **history;
+        size_t history_head;
+        size_t history_count;
+
+        subscription_t *subscriptions;
+};
+
+/**
+        A client receiving the records of a provider
+
+        Usually, a client is subscribed to a single provider. Multi-channel
+        clients are subscribed to several providers, and each record is
+        prefixed with the "event:" line in tag.
+*/
+struct subscription {
+        struct subscription *provider_prev;
+        struct subscription *provider_next;
+        struct subscription *client_next;
 
-        char last;
-        bool clean;
+        provider_t *provider;
+        client_t *client;
 
-        handler_t handler;
-        client_t *clients;
+        event_t *tag;
+        bool active;
 };
 
 
@@ -133,109 +254,517 @@ static int run_command(const char *command) {
         }
 }
 
-/** Write a whole buffer to a FD, retrying on partial writes */
-static bool feed(int fd, void *buffer, size_t len) {
-        while (len) {
-                ssize_t w = write(fd, buffer, len);
-                if (w == 0)
-                        return false;
-                if (w < 0) {
-                        if (errno == EINTR)
-                                continue;
+/** Returns the current value of the monotonic clock in milliseconds */
+static uint64_t now_ms(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** FNV-1a hash of a command string */
+static uint32_t command_hash(const char *command) {
+        uint32_t hash = 2166136261u;
+
+        for (const unsigned char *c = (const unsigned char *)command; *c; c++) {
+                hash ^= *c;
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+/** Creates a new event with the given content */
+static event_t * event_new(const char *data, size_t len) {
+        event_t *ev = malloc(sizeof(*ev) + len);
+        ev->refcount = 1;
+        ev->len = len;
+        memcpy(ev->data, data, len);
+
+        return ev;
+}
+
+static event_t * event_ref(event_t *ev) {
+        ev->refcount++;
+        return ev;
+}
+
+static void event_unref(event_t *ev) {
+        if (!ev || --ev->refcount)
+                return;
+
+        free(ev);
+}
+
+/**
+        Writes as much of a buffer as possible to a client without blocking
+
+        Returns the number of bytes written, or -1 when the client has failed.
+*/
+static ssize_t client_write(client_t *c, const struct iovec *iov, int iovcnt) {
+        while (true) {
+                ssize_t w = writev(c->fd, iov, iovcnt);
+                if (w >= 0)
+                        return w;
 
-                        return false;
+                switch (errno) {
+                case EINTR:
+                        continue;
+
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                        return 0;
+
+                default:
+                        c->state = CLIENT_STATE_CLOSE;
+                        return -1;
                 }
+        }
+}
+
+/** Enables EPOLLOUT for a client as long as its output queue is not empty */
+static void client_update_events(client_t *c) {
+        uint32_t events = c->queue_count ? EPOLLOUT : 0;
+        if (c->state == CLIENT_STATE_COMMAND)
+                events = EPOLLIN;
 
-                buffer += w;
-                len -= w;
+        if (c->event.events == events)
+                return;
+
+        c->event.events = events;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &c->event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+                exit(1);
         }
+}
+
+/** Removes a client from the list of clients still sending their command */
+static void client_unpend(client_t *c) {
+        if (c->pending_next)
+                c->pending_next->pending_prev = c->pending_prev;
+        else
+                pending_tail = c->pending_prev;
+
+        if (c->pending_prev)
+                c->pending_prev->pending_next = c->pending_next;
+        else
+                pending_head = c->pending_next;
 
-        return true;
+        free(c->command);
+        c->command = NULL;
 }
 
 /**
-        Creates a new client for a given socket FD and adds
-        it to a provider's client list
+        Creates a new client for a freshly accepted socket FD
+
+        The client waits for its command to be received until the command
+        timeout expires.
 */
-static void client_add(provider_t *p, int fd) {
+static void client_new(int fd) {
         client_t *c = calloc(1, sizeof(*c));
+        c->type = HANDLE_TYPE_CLIENT;
+        c->state = CLIENT_STATE_COMMAND;
         c->fd = fd;
+        c->command = malloc(MAX_REQUEST_LEN + 1);
+        c->deadline = now_ms() + command_timeout;
+
+        c->pending_prev = pending_tail;
+        if (pending_tail)
+                pending_tail->pending_next = c;
+        else
+                pending_head = c;
+        pending_tail = c;
 
-        c->next = p->clients;
-        p->clients = c;
+        c->event.events = EPOLLIN;
+        c->event.data.ptr = c;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &c->event) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+                exit(1);
+        }
 }
 
-/** Writes a buffer to a client's FD if the client is active */
-static void client_feed(client_t *c, void *buffer, size_t len) {
-        if (!feed(c->fd, buffer, len))
-                c->state = CLIENT_STATE_CLOSE;
+/** Returns the event at a given position of a client's output queue */
+static inline event_t ** client_queue_at(client_t *c, size_t i) {
+        return &c->queue[(c->queue_head + i) % c->queue_slots];
+}
+
+/** Appends an event reference to a client's output queue */
+static void client_push(client_t *c, event_t *ev) {
+        if (c->queue_count == c->queue_slots) {
+                size_t slots = c->queue_slots ? 2*c->queue_slots : 4;
+                event_t **queue = malloc(slots * sizeof(*queue));
+
+                for (size_t i = 0; i < c->queue_count; i++)
+                        queue[i] = *client_queue_at(c, i);
+
+                free(c->queue);
+                c->queue = queue;
+                c->queue_slots = slots;
+                c->queue_head = 0;
+        }
+
+        *client_queue_at(c, c->queue_count) = event_ref(ev);
+        c->queue_count++;
+        c->queue_len += ev->len;
+}
+
+/** Removes the first event from a client's output queue */
+static void client_pop(client_t *c) {
+        event_t **ev = client_queue_at(c, 0);
+
+        c->queue_len -= (*ev)->len - c->queue_offset;
+        event_unref(*ev);
+
+        c->queue_head = (c->queue_head + 1) % c->queue_slots;
+        c->queue_count--;
+        c->queue_offset = 0;
+}
+
+/** Writes out as much of a client's output queue as possible */
+static void client_flush(client_t *c) {
+        while (c->queue_count && c->state != CLIENT_STATE_CLOSE) {
+                struct iovec iov[MAX_IOV];
+                size_t n = c->queue_count < MAX_IOV ? c->queue_count : MAX_IOV;
+
+                for (size_t i = 0; i < n; i++) {
+                        event_t *ev = *client_queue_at(c, i);
+                        iov[i].iov_base = ev->data;
+                        iov[i].iov_len = ev->len;
+                }
+
+                iov[0].iov_base += c->queue_offset;
+                iov[0].iov_len -= c->queue_offset;
+
+                ssize_t w = client_write(c, iov, n);
+                if (w <= 0)
+                        break;
+
+                for (size_t i = 0; i < n && (size_t)w >= iov[i].iov_len; i++) {
+                        w -= iov[i].iov_len;
+                        client_pop(c);
+                }
+
+                if (w) {
+                        c->queue_offset += w;
+                        c->queue_len -= w;
+                        break;
+                }
+        }
+}
+
+/**
+        Queues an event (prefixed by an optional tag event) for a client and
+        writes out as much as possible without blocking
+
+        When the output queue of a slow client is full, the event is dropped
+        or the client is disconnected, depending on the overflow policy. As
+        events are always complete records, dropping them doesn't corrupt
+        the stream. An empty queue always accepts an event, so oversized
+        events (in particular the header) are never dropped.
+*/
+static void client_feed(client_t *c, event_t *tag, event_t *ev) {
+        if (c->state == CLIENT_STATE_CLOSE)
+                return;
+
+        size_t len = ev->len + (tag ? tag->len : 0);
+        if (c->queue_count && c->queue_len + len > queue_size) {
+                if (overflow_policy == OVERFLOW_DISCONNECT)
+                        c->state = CLIENT_STATE_CLOSE;
+
+                return;
+        }
+
+        if (tag)
+                client_push(c, tag);
+        client_push(c, ev);
+
+        client_flush(c);
+        client_update_events(c);
 }
 
 static void client_free(client_t *c) {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+                exit(1);
+        }
+
         close(c->fd);
+
+        if (c->state == CLIENT_STATE_COMMAND)
+                client_unpend(c);
+
+        while (c->queue_count)
+                client_pop(c);
+
+        free(c->queue);
         free(c);
 }
 
-/** Writes a buffer to all active clients of a given provider */
-static void provider_handle_data(provider_t *provider, void *buffer, size_t len) {
-        if (!len)
+/**
+        Creates a subscription of a client to a provider
+
+        If name is not NULL, the records are tagged with it as event type.
+*/
+static subscription_t * subscription_new(client_t *c, provider_t *p, const char *name) {
+        subscription_t *s = calloc(1, sizeof(*s));
+        s->provider = p;
+        s->client = c;
+
+        if (name) {
+                size_t len = strlen(name);
+                char tag[len + 8];
+
+                memcpy(tag, "event: ", 7);
+                memcpy(tag + 7, name, len);
+                tag[len + 7] = '\n';
+
+                s->tag = event_new(tag, len + 8);
+        }
+
+        s->provider_next = p->subscriptions;
+        if (p->subscriptions)
+                p->subscriptions->provider_prev = s;
+        p->subscriptions = s;
+
+        s->client_next = c->subscriptions;
+        c->subscriptions = s;
+
+        return s;
+}
+
+/** Removes a subscription from its provider and client */
+static void subscription_del(subscription_t *s) {
+        if (s->provider_next)
+                s->provider_next->provider_prev = s->provider_prev;
+
+        if (s->provider_prev)
+                s->provider_prev->provider_next = s->provider_next;
+        else
+                s->provider->subscriptions = s->provider_next;
+
+        for (subscription_t **sp = &s->client->subscriptions; *sp; sp = &(*sp)->client_next) {
+                if (*sp == s) {
+                        *sp = s->client_next;
+                        break;
+                }
+        }
+
+        event_unref(s->tag);
+        free(s);
+}
+
+/**
+        Sends the header to a new subscriber once it is available, followed
+        by the most recent records, so the client doesn't have to wait for the
+        next record to get the current state
+
+        Multi-channel clients get a common header instead of the provider's.
+*/
+static void subscription_activate(subscription_t *s) {
+        provider_t *p = s->provider;
+
+        if (s->active || !p->header)
+                return;
+
+        s->active = true;
+
+        if (!s->tag)
+                client_feed(s->client, NULL, p->header);
+
+        for (size_t i = 0; i < p->history_count; i++)
+                client_feed(s->client, s->tag, p->history[(p->history_head + i) % replay_count]);
+}
+
+/** Adds a record to a provider's history, dropping the oldest one if it is full */
+static void provider_remember(provider_t *p, event_t *ev) {
+        if (!replay_count) {
+                event_unref(ev);
                 return;
+        }
 
-        for (client_t *c = provider->clients; c; c = c->next) {
-                if (c->state == CLIENT_STATE_ACTIVE)
-                        client_feed(c, buffer, len);
+        if (p->history_count == replay_count) {
+                event_unref(p->history[p->history_head]);
+                p->history_head = (p->history_head + 1) % replay_count;
+                p->history_count--;
         }
+
+        p->history[(p->history_head + p->history_count) % replay_count] = ev;
+        p->history_count++;
 }
 
 /**
-        Adds a buffer to the header buffer of a provider
+        Handles a complete record read from a provider
 
-        The HTTP header generated by the provider is reproduced for each new
-        client connecting for the same provider, so it must be stored in a
-        buffer. New providers are using this hander. As soon as the input is
-        clean (a double newline terminating the header has been received), this
-        handler replaces itself with provider_handle_data().
+        The first record is the HTTP header generated by the provider. It is
+        reproduced for each new client connecting for the same provider, so it
+        must be stored; all later records are sent to all active clients.
 */
-static void provider_handle_header(provider_t *provider, void *buffer, size_t len) {
-        if (provider->clean)
-                provider->handler = provider_handle_data;
+static void provider_handle_record(provider_t *p) {
+        event_t *ev = p->record;
+        p->record = NULL;
+        p->record_buflen = 0;
+
+        if (!ev)
+                return;
+
+        ev = realloc(ev, sizeof(*ev) + ev->len);
+        ev->refcount = 1;
+
+        if (!p->header) {
+                p->header = ev;
+
+                for (subscription_t *s = p->subscriptions; s; s = s->provider_next)
+                        subscription_activate(s);
+
+                return;
+        }
+
+        for (subscription_t *s = p->subscriptions; s; s = s->provider_next) {
+                if (s->active)
+                        client_feed(s->client, s->tag, ev);
+        }
+
+        provider_remember(p, ev);
+}
+
+/** Appends a buffer to the record currently being assembled */
+static void provider_append(provider_t *p, const char *buffer, size_t len) {
+        if (!len || p->discard)
+                return;
 
-        if (!len)
+        size_t old_len = p->record ? p->record->len : 0;
+        size_t new_len = old_len + len;
+
+        if (new_len > MAX_RECORD_LEN) {
+                syslog(LOG_WARNING, "dropping oversized record from `%s'", p->command);
+
+                free(p->record);
+                p->record = NULL;
+                p->record_buflen = 0;
+                p->discard = true;
                 return;
+        }
+
+        if (new_len > p->record_buflen) {
+                if (!p->record_buflen)
+                        p->record_buflen = 128;
+
+                while (new_len > p->record_buflen)
+                        p->record_buflen <<= 1;
+
+                p->record = realloc(p->record, sizeof(*p->record) + p->record_buflen);
+        }
+
+        memcpy(p->record->data + old_len, buffer, len);
+        p->record->len = new_len;
+}
 
-        size_t new_len = provider->header_len + len;
-        if (new_len < provider->header_len)
-                goto overflow;
+/**
+        Splits data read from a provider into records
+
+        Records are terminated by a double newline, which may span two reads;
+        the newline field remembers if the previous read ended with a newline.
+*/
+static void provider_input(provider_t *p, const char *buffer, size_t len) {
+        const char *end = buffer + len;
+        const char *start = buffer, *pos = buffer;
+        const char *line = p->newline ? buffer : NULL;
+
+        while (pos < end) {
+                const char *nl = memchr(pos, '\n', end - pos);
+                if (!nl)
+                        break;
 
-        if (new_len > provider->header_buflen) {
-                if (!provider->header_buflen)
-                        provider->header_buflen = 128;
+                pos = nl + 1;
 
-                while (new_len > provider->header_buflen) {
-                        provider->header_buflen <<= 1;
-                        if (!provider->header_buflen)
-                                goto overflow;
+                if (nl != line) {
+                        line = pos;
+                        continue;
                 }
 
-                provider->header = realloc(provider->header, provider->header_buflen);
+                provider_append(p, start, pos - start);
+                if (p->discard)
+                        p->discard = false;
+                else
+                        provider_handle_record(p);
+
+                start = pos;
+                line = NULL;
         }
 
-        memcpy(provider->header+provider->header_len, buffer, len);
-        provider->header_len = new_len;
+        provider_append(p, start, end - start);
+        p->newline = (line == end);
+}
 
-        return;
+/** Adds a provider to the hash bucket for its command */
+static void provider_link(provider_t *p) {
+        provider_t **bucket = &providers[p->hash & (provider_buckets-1)];
 
-overflow:
-        /* Just a safeguard, we're OOM long before
-         * an overflow
-         *
-         * We can't really do anything useful here,
-         * so we just drop the buffer ¯\_(ツ)_/¯
-         */
-        free(provider->header);
-        provider->header_len = 0;
-        provider->header_buflen = 0;
-        return;
+        p->prev = NULL;
+        p->next = *bucket;
+        if (*bucket)
+                (*bucket)->prev = p;
+        *bucket = p;
+}
+
+/** Adds a provider to the hash table, growing the table when it gets too full */
+static void provider_insert(provider_t *p) {
+        if (provider_count >= provider_buckets) {
+                provider_t **old = providers;
+                size_t old_buckets = provider_buckets;
+
+                provider_buckets = old_buckets ? 2*old_buckets : MIN_PROVIDER_BUCKETS;
+                providers = calloc(provider_buckets, sizeof(*providers));
+
+                for (size_t i = 0; i < old_buckets; i++) {
+                        for (provider_t *q = old[i], *next; q; q = next) {
+                                next = q->next;
+                                provider_link(q);
+                        }
+                }
+
+                free(old);
+        }
+
+        provider_link(p);
+        provider_count++;
+}
+
+/** Starts the linger time of a provider that has lost its last client */
+static void provider_idle(provider_t *p) {
+        if (p->idle)
+                return;
+
+        p->idle = true;
+        p->idle_expiry = now_ms() + linger_time;
+
+        p->idle_next = NULL;
+        p->idle_prev = idle_tail;
+        if (idle_tail)
+                idle_tail->idle_next = p;
+        else
+                idle_head = p;
+        idle_tail = p;
+}
+
+/** Removes a provider from the idle list */
+static void provider_unidle(provider_t *p) {
+        if (!p->idle)
+                return;
+
+        if (p->idle_next)
+                p->idle_next->idle_prev = p->idle_prev;
+        else
+                idle_tail = p->idle_prev;
+
+        if (p->idle_prev)
+                p->idle_prev->idle_next = p->idle_next;
+        else
+                idle_head = p->idle_next;
+
+        p->idle = false;
 }
 
 /** Runs the given command, creating a new provider for the command's stdout pipe */
@@ -249,10 +778,12 @@ static provider_t * provider_new(const char *command) {
         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
         provider_t *p = calloc(1, sizeof(*p));
+        p->type = HANDLE_TYPE_PROVIDER;
         p->command = strdup(command);
         p->fd = fd;
 
-        p->handler = provider_handle_header;
+        if (replay_count)
+                p->history = calloc(replay_count, sizeof(*p->history));
 
         p->event.events = EPOLLIN|EPOLLRDHUP;
         p->event.data.ptr = p;
@@ -262,10 +793,8 @@ static provider_t * provider_new(const char *command) {
                 exit(1);
         }
 
-        if (providers)
-                providers->prev = p;
-        p->next = providers;
-        providers = p;
+        p->hash = command_hash(command);
+        provider_insert(p);
 
         return p;
 }
@@ -273,19 +802,48 @@ static provider_t * provider_new(const char *command) {
 /**
         Either retrieves an existing provider for the given command or
         creates a new one if none exists
+
+        A lingering provider is reused and becomes active again.
 */
 static provider_t * provider_get(const char *command) {
-        provider_t *p;
-        for (p = providers; p; p = p->next) {
-                if (!strcmp(p->command, command))
-                        return p;
+        if (provider_buckets) {
+                uint32_t hash = command_hash(command);
+
+                for (provider_t *p = providers[hash & (provider_buckets-1)]; p; p = p->next) {
+                        if (p->hash == hash && p->fd >= 0 && !strcmp(p->command, command)) {
+                                provider_unidle(p);
+                                return p;
+                        }
+                }
         }
 
         return provider_new(command);
 }
 
 /**
-        Cleans up behind a provider, removes it from the global provider list
+        Closes the stdout pipe of a provider after its command has exited
+
+        The following provider_maintain() removes all its subscriptions and
+        deletes the provider. Output already queued is kept by the clients,
+        which are only closed once they have sent it.
+*/
+static void provider_close(provider_t *p) {
+        if (p->fd < 0)
+                return;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+                exit(1);
+        }
+
+        close(p->fd);
+        p->fd = -1;
+}
+
+static void client_close(client_t *c);
+
+/**
+        Cleans up behind a provider, removes it from the provider hash table
         and frees the provider */
 static void provider_del(provider_t *p) {
         if (p->next)
@@ -294,87 +852,125 @@ static void provider_del(provider_t *p) {
         if (p->prev)
                 p->prev->next = p->next;
         else
-                providers = p->next;
+                providers[p->hash & (provider_buckets-1)] = p->next;
 
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->fd, NULL) < 0) {
-		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
-                exit(1);
-        }
+        provider_count--;
+
+        provider_unidle(p);
+        provider_close(p);
+
+        while (p->subscriptions) {
+                client_t *c = p->subscriptions->client;
 
-        for (client_t *c = p->clients; c; c = p->clients) {
-                p->clients = c->next;
-                client_free(c);
+                subscription_del(p->subscriptions);
+                client_close(c);
         }
 
         free(p->command);
-        close(p->fd);
-        free(p->header);
+        event_unref(p->header);
+        free(p->record);
+
+        for (size_t i = 0; i < p->history_count; i++)
+                event_unref(p->history[(p->history_head + i) % replay_count]);
+        free(p->history);
+
         free(p);
 }
 
 /**
-        Periodic maintenance
+        Deletes a provider that has lost its last subscriber, returning false
+
+        Providers whose command is still running are kept around for the
+        linger time instead, so reconnecting clients can reuse them.
+*/
+static bool provider_check(provider_t *p) {
+        if (p->subscriptions)
+                return true;
 
-        New clients are activated as soon as the input is clean (we have just
-        read a double newline); clients that have failed are deleted.
+        if (p->fd >= 0 && linger_time) {
+                provider_idle(p);
+                return true;
+        }
+
+        provider_del(p);
+        return false;
+}
+
+/** Removes all subscriptions of a client and frees it */
+static void client_close(client_t *c) {
+        while (c->subscriptions) {
+                provider_t *p = c->subscriptions->provider;
+
+                subscription_del(c->subscriptions);
+                provider_check(p);
+        }
 
-        When all clients have been removed, the provider itself is deleted and
-        false is returned.
+        client_free(c);
+}
+
+/**
+        Closes a client that has failed, or that has lost all its
+        subscriptions and has sent all queued output
 */
-static bool provider_maintain(provider_t *p) {
-        for (client_t **cp = &p->clients, *c = *cp; c; c = *cp) {
-                switch (c->state) {
-                case CLIENT_STATE_NEW:
-                        if (p->handler == provider_handle_header)
-                                break;
-
-                        /*
-                                Set state first, in case client_feed()
-                                sets the state to CLIENT_STATE_CLOSE
-                        */
-                        c->state = CLIENT_STATE_HEADER_SENT;
-                        client_feed(c, p->header, p->header_len);
-                        continue;
+static void client_check(client_t *c) {
+        if (c->state == CLIENT_STATE_CLOSE || (!c->subscriptions && !c->queue_count))
+                client_close(c);
+}
 
-                case CLIENT_STATE_HEADER_SENT:
-                        if (p->clean)
-                                c->state = CLIENT_STATE_ACTIVE;
+/**
+        Periodic maintenance
 
-                        break;
+        Subscriptions of clients that have failed are deleted. After the
+        provider's command has exited, all subscriptions are removed; clients
+        without other subscriptions are closed as soon as their output queues
+        have been drained.
 
-                case CLIENT_STATE_ACTIVE:
-                        break;
+        When all subscriptions have been removed, the provider itself is
+        deleted (or starts lingering, see provider_check()).
+*/
+static bool provider_maintain(provider_t *p) {
+        for (subscription_t *s = p->subscriptions, *next; s; s = next) {
+                client_t *c = s->client;
+                next = s->provider_next;
 
-                case CLIENT_STATE_CLOSE:
-                        *cp = c->next;
-                        client_free(c);
+                if (c->state != CLIENT_STATE_CLOSE && p->fd >= 0)
                         continue;
-                }
 
-                cp = &c->next;
+                subscription_del(s);
+                client_check(c);
         }
 
-        if (!p->clients) {
-                provider_del(p);
-                return false;
-        }
+        return provider_check(p);
+}
 
-        return true;
+/** Deletes all providers whose linger time has expired */
+static void providers_expire(void) {
+        uint64_t now = now_ms();
+
+        while (idle_head && idle_head->idle_expiry <= now)
+                provider_del(idle_head);
 }
 
 /**
-        Handles input data from a provider
+        Returns the epoll timeout until the next lingering provider or pending
+        client expires
+*/
+static int epoll_timeout(void) {
+        uint64_t deadline = UINT64_MAX;
 
-        clean must be set to true if we are at the end of the header or an SSE
-        record (a double newline).
+        if (idle_head)
+                deadline = idle_head->idle_expiry;
+        if (pending_head && pending_head->deadline < deadline)
+                deadline = pending_head->deadline;
 
-        Returns false when the provider has been deleted because all clients
-        disappeared.
-*/
-static bool provider_data(provider_t *provider, void *buf, size_t len, bool clean) {
-        provider->clean = clean;
-        provider->handler(provider, buf, len);
-        return provider_maintain(provider);
+        if (deadline == UINT64_MAX)
+                return -1;
+
+        uint64_t now = now_ms();
+        if (deadline <= now)
+                return 0;
+
+        return deadline - now;
 }
 
 static void init_epoll(void) {
@@ -387,19 +983,19 @@ static void init_epoll(void) {
 
 static void unlink_socket(void) {
         if (listen_fd >= 0) {
-                unlink(SSE_MULTIPLEX_SOCKET);
+                unlink(socket_path);
                 listen_fd = -1;
         }
 }
 
 static void create_socket(void) {
-        listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
         if (listen_fd < 0) {
                 fprintf(stderr, "socket: %s\n", strerror(errno));
                 exit(1);
         }
 
-        size_t socket_len = strlen(SSE_MULTIPLEX_SOCKET);
+        size_t socket_len = strlen(socket_path);
 	size_t len = offsetof(struct sockaddr_un, sun_path) + socket_len + 1;
 	uint8_t buf[len];
 	memset(buf, 0, len);
@@ -407,14 +1003,14 @@ static void create_socket(void) {
 	struct sockaddr_un *sa = (void*)buf;
 
 	sa->sun_family = AF_UNIX;
-	memcpy(sa->sun_path, SSE_MULTIPLEX_SOCKET, socket_len+1);
+	memcpy(sa->sun_path, socket_path, socket_len+1);
 
         mode_t old_umask = umask(077);
 
         if (bind(listen_fd, (struct sockaddr*)sa, len)) {
 		switch (errno) {
 		case EADDRINUSE:
-			fprintf(stderr, "Unable to bind socket: the path `%s' already exists\n", SSE_MULTIPLEX_SOCKET);
+			fprintf(stderr, "Unable to bind socket: the path `%s' already exists\n", socket_path);
                         break;
 
 		default:
@@ -432,7 +1028,7 @@ static void create_socket(void) {
                 exit(1);
         }
 
-        if (listen(listen_fd, 16) < 0) {
+        if (listen(listen_fd, listen_backlog) < 0) {
                 fprintf(stderr, "listen: %s\n", strerror(errno));
                 exit(1);
         }
@@ -466,119 +1062,329 @@ static void setup_signals(void) {
 
 /** Handles input from a provider */
 static void epoll_handle_provider(provider_t *provider) {
-        /*
-                The "last" field contains the last character from the previously
-                read buffer. This allows us to search for double newlines that
-                span two reads.
-        */
-        struct {
-                char last;
-                char buf[1024];
-        } data;
+        char buf[4096];
 
-        data.last = provider->last;
+        ssize_t r = read(provider->fd, buf, sizeof(buf));
+        if (r < 0 && (errno == EINTR || errno == EAGAIN))
+                return;
 
-        ssize_t r = read(provider->fd, data.buf, sizeof(data.buf));
         if (r <= 0) {
-                if (r < 0 && errno == EINTR)
-                        return;
-
                 /*
-                        EOF before header end: just output the whole block
-                        by pretending a clean state and delete the provider
+                        EOF: handle an unterminated last record (or header)
+                        like a complete one and close the provider
                 */
-                if (!provider_data(provider, NULL, 0, true))
-                        return;
-                provider_del(provider);
-                return;
-        }
-
-        provider->last = data.buf[r-1];
+                if (!provider->discard)
+                        provider_handle_record(provider);
 
-        char *sep = memmem(&data, 1 + r, "\n\n", 2);
-
-        /*
-                When we found a separator, split the message, so
-                provider_maintain() is run as soon as possible, in case a new
-                client needs to be activated.
-        */
-        size_t len1 = sep ? (sep + 2) - data.buf : r;
-        if (!provider_data(provider, data.buf, len1, sep))
-                return;
-
-        if (!sep)
+                provider_close(provider);
+                provider_maintain(provider);
                 return;
+        }
 
-        /*
-                If there is a second chunk after the first double newline,
-                we don't need to split it further: All new clients have already
-                been enabled
-        */
-        size_t len2 = r - len1;
-        if (len2)
-                provider_data(
-                        provider, data.buf + len1, len2,
-                        data.buf[r-2] == '\n' && data.buf[r-1] == '\n'
-                );
+        provider_input(provider, buf, r);
+        provider_maintain(provider);
 }
 
+/** Accepts all pending connections on the listening socket */
 static void epoll_handle_accept(uint32_t events) {
         if (events != EPOLLIN) {
 		syslog(LOG_ERR, "unexpected event on listening socket: %u\n", (unsigned)events);
                 exit(1);
         }
 
-        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
-        if (fd < 0) {
-		syslog(LOG_WARNING, "accept4: %s\n", strerror(errno));
-                return;
+        while (true) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK);
+                if (fd < 0) {
+                        switch (errno) {
+                        case EINTR:
+                        case ECONNABORTED:
+                                continue;
+
+                        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                        case EWOULDBLOCK:
+#endif
+                                return;
+
+                        default:
+		                syslog(LOG_WARNING, "accept4: %s\n", strerror(errno));
+                                return;
+                        }
+                }
+
+                client_new(fd);
+        }
+}
+
+/**
+        Subscribes a client to the providers for the request it has sent
+
+        A request is either a single command, or, for multi-channel clients, a
+        NUL byte followed by NUL-terminated pairs of event names and commands.
+        Every command may only be used once per request.
+*/
+static void client_subscribe(client_t *c) {
+        char *request = c->command;
+        size_t len = c->command_len;
+        request[len] = 0;
+
+        c->command = NULL;
+        client_unpend(c);
+
+        c->state = CLIENT_STATE_OPEN;
+        client_update_events(c);
+
+        if (len && !request[0]) {
+                char *pos = request + 1, *end = request + len;
+                size_t n_channels = 0;
+
+                while (pos < end) {
+                        char *name = pos;
+                        char *command = name + strlen(name) + 1;
+                        if (command >= end)
+                                goto error;
+
+                        pos = command + strlen(command) + 1;
+
+                        if (!*name || strpbrk(name, "\r\n") || !*command)
+                                goto error;
+
+                        if (++n_channels > MAX_CHANNELS)
+                                goto error;
+
+                        for (subscription_t *s = c->subscriptions; s; s = s->client_next) {
+                                if (!strcmp(s->provider->command, command))
+                                        goto error;
+                        }
+
+                        provider_t *p = provider_get(command);
+                        if (!p)
+                                goto error;
+
+                        subscription_new(c, p, name);
+                }
+
+                client_feed(c, NULL, multi_header);
+        }
+        else {
+                provider_t *p = provider_get(request);
+                if (!p)
+                        goto error;
+
+                subscription_new(c, p, NULL);
         }
 
-        char command[1024];
-        char *c = command;
+        for (subscription_t *s = c->subscriptions; s; s = s->client_next)
+                subscription_activate(s);
+
+        free(request);
+        client_check(c);
+        return;
+
+error:
+        syslog(LOG_WARNING, "invalid request\n");
+
+        free(request);
+        c->state = CLIENT_STATE_CLOSE;
+        client_check(c);
+}
+
+/**
+        Receives the request from a client
+
+        The request is complete when the client shuts down its write side.
+*/
+static void client_handle_command(client_t *c, uint32_t events) {
         while (true) {
-                ssize_t r = read(fd, c, command + (sizeof(command)-1) - c);
+                ssize_t r = read(c->fd, c->command + c->command_len, MAX_REQUEST_LEN + 1 - c->command_len);
                 if (r < 0) {
-                        close(fd);
-                        return;
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                if (events & (EPOLLERR|EPOLLHUP))
+                                        break;
+
+                                return;
+                        }
+
+                        break;
                 }
 
                 if (r == 0) {
-                        *c = 0;
-                        break;
+                        client_subscribe(c);
+                        return;
                 }
 
-                c += r;
+                c->command_len += r;
+                if (c->command_len > MAX_REQUEST_LEN) {
+                        syslog(LOG_WARNING, "request too long\n");
+                        break;
+                }
         }
 
-        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        client_free(c);
+}
+
+/** Closes all clients that haven't sent their command before the timeout */
+static void clients_expire(void) {
+        uint64_t now = now_ms();
+
+        while (pending_head && pending_head->deadline <= now)
+                client_free(pending_head);
+}
 
-        provider_t *p = provider_get(command);
-        if (!p) {
-                close(fd);
+/** Handles output readiness and hangups of a client */
+static void epoll_handle_client(client_t *c, uint32_t events) {
+        if (c->state == CLIENT_STATE_COMMAND) {
+                client_handle_command(c, events);
                 return;
         }
 
-        client_add(p, fd);
-        provider_maintain(p);
+        if (events & (EPOLLERR|EPOLLHUP))
+                c->state = CLIENT_STATE_CLOSE;
+        else if (events & EPOLLOUT)
+                client_flush(c);
+
+        if (c->state != CLIENT_STATE_CLOSE)
+                client_update_events(c);
+
+        client_check(c);
+}
+
+static void epoll_handle(void *ptr, uint32_t events) {
+        handle_type_t *type = ptr;
+
+        switch (*type) {
+        case HANDLE_TYPE_PROVIDER:
+                epoll_handle_provider(ptr);
+                break;
+
+        case HANDLE_TYPE_CLIENT:
+                epoll_handle_client(ptr, events);
+                break;
+        }
 }
 
 void cleanup(void) {
-        while (providers)
-                provider_del(providers);
+        while (pending_head)
+                client_free(pending_head);
+
+        for (size_t i = 0; i < provider_buckets; i++) {
+                while (providers[i])
+                        provider_del(providers[i]);
+        }
+
+        free(providers);
+        event_unref(multi_header);
+}
+
+static void usage(void) {
+        fprintf(stderr, "Usage: sse-multiplexd [-h] [-q <queue size>] [-o drop|disconnect] [-r <replay count>] [-l <linger time in ms>] [-s <socket>] [-t <command timeout in ms>] [-b <listen backlog>]\n");
+}
+
+static void parse_cmdline(int argc, char *argv[]) {
+        int c;
+        char *endptr;
+        unsigned long val;
+
+        while ((c = getopt(argc, argv, "q:o:r:l:s:t:b:h")) != -1) {
+                switch (c) {
+                case 'q':
+                        val = strtoul(optarg, &endptr, 0);
+                        if (!*optarg || *endptr || !val || val > SIZE_MAX) {
+                                fprintf(stderr, "Invalid queue size `%s'\n", optarg);
+                                exit(1);
+                        }
+
+                        queue_size = val;
+                        break;
+
+                case 'o':
+                        if (!strcmp(optarg, "drop")) {
+                                overflow_policy = OVERFLOW_DROP;
+                        }
+                        else if (!strcmp(optarg, "disconnect")) {
+                                overflow_policy = OVERFLOW_DISCONNECT;
+                        }
+                        else {
+                                fprintf(stderr, "Invalid overflow policy `%s'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+
+                case 'r':
+                        val = strtoul(optarg, &endptr, 0);
+                        if (!*optarg || *endptr || val > 1024) {
+                                fprintf(stderr, "Invalid replay count `%s'\n", optarg);
+                                exit(1);
+                        }
+
+                        replay_count = val;
+                        break;
+
+                case 'l':
+                        val = strtoul(optarg, &endptr, 0);
+                        if (!*optarg || *endptr || val > INT_MAX) {
+                                fprintf(stderr, "Invalid linger time `%s'\n", optarg);
+                                exit(1);
+                        }
+
+                        linger_time = val;
+                        break;
+
+                case 's':
+                        socket_path = optarg;
+                        break;
+
+                case 't':
+                        val = strtoul(optarg, &endptr, 0);
+                        if (!*optarg || *endptr || !val || val > INT_MAX) {
+                                fprintf(stderr, "Invalid command timeout `%s'\n", optarg);
+                                exit(1);
+                        }
+
+                        command_timeout = val;
+                        break;
+
+                case 'b':
+                        val = strtoul(optarg, &endptr, 0);
+                        if (!*optarg || *endptr || !val || val > INT_MAX) {
+                                fprintf(stderr, "Invalid listen backlog `%s'\n", optarg);
+                                exit(1);
+                        }
+
+                        listen_backlog = val;
+                        break;
+
+                case 'h':
+                        usage();
+                        exit(0);
+
+                default:
+                        usage();
+                        exit(1);
+                }
+        }
+
+        if (optind < argc) {
+                usage();
+                exit(1);
+        }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+        parse_cmdline(argc, argv);
+
+        static const char header[] = "Content-type: text/event-stream\n\n";
+        multi_header = event_new(header, sizeof(header)-1);
+
         init_epoll();
         create_socket();
         setup_signals();
 
         while (running) {
                 struct epoll_event event;
-                int ret = epoll_wait(epoll_fd, &event, 1, -1);
-                if (ret == 0)
-                        continue;
-
+                int ret = epoll_wait(epoll_fd, &event, 1, epoll_timeout());
                 if (ret < 0) {
                         if (errno == EINTR)
                                 continue;
@@ -587,10 +1393,15 @@ int main() {
                         exit(1);
                 }
 
-                if (event.data.ptr == &listen_event)
-                        epoll_handle_accept(event.events);
-                else
-                        epoll_handle_provider(event.data.ptr);
+                if (ret > 0) {
+                        if (event.data.ptr == &listen_event)
+                                epoll_handle_accept(event.events);
+                        else
+                                epoll_handle(event.data.ptr, event.events);
+                }
+
+                providers_expire();
+                clients_expire();
         }
 
         cleanup();
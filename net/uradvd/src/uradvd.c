@@ -27,11 +27,11 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
-#include <ifaddrs.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -42,6 +42,7 @@
 
 #include <arpa/inet.h>
 
+#include <linux/filter.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 
@@ -51,14 +52,18 @@
 #include <netinet/icmp6.h>
 
 #include <sys/types.h>
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 
 
-#define MAX_PREFIXES 8
-#define MAX_RDNSS 3
+/* Advertisements must fit into the IPv6 minimum MTU, as they may not be fragmented */
+#define MAX_ADVERT_LEN (1280u - 40u)
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
 
 /* These are in seconds */
 #define AdvValidLifetime 86400u
@@ -67,6 +72,14 @@
 #define AdvCurHopLimit 64u
 #define AdvRDNSSLifetime 1200u
 
+/*
+  A deleted prefix is advertised as deprecated this many times before it is
+  dropped. Hosts don't shorten a valid lifetime below two hours (RFC 4862), so
+  a longer one wouldn't take effect sooner.
+*/
+#define WITHDRAW_ADVERTS 3u
+#define WithdrawnValidLifetime 7200u
+
 #define MinRtrAdvInterval 200u
 #define MaxRtrAdvInterval 600u
 
@@ -74,6 +87,30 @@
 #define MAX_RA_DELAY_TIME 500u
 #define MIN_DELAY_BETWEEN_RAS 3000u
 
+/* Rate limits for unicast responses to solicitations (intervals in milliseconds) */
+#define SOLICIT_SOURCE_INTERVAL 3000u
+#define SOLICIT_SOURCE_BURST 3u
+#define SOLICIT_IFACE_INTERVAL 100u
+#define SOLICIT_IFACE_BURST 20u
+
+/* Number of soliciting hosts whose rate limit state is kept */
+#define SOLICIT_SOURCES 256u
+
+
+struct prefix {
+	struct in6_addr addr;
+	bool onlink;
+	uint32_t valid_lifetime;
+	uint32_t preferred_lifetime;
+
+	/* Remaining advertisements of a deleted prefix, 0 if it hasn't been deleted */
+	unsigned withdraw;
+};
+
+struct rdnss {
+	struct in6_addr addr;
+	uint32_t lifetime;
+};
 
 struct icmpv6_opt {
 	uint8_t type;
@@ -83,10 +120,36 @@ struct icmpv6_opt {
 
 
 struct iface {
+	const char *ifname;
+
 	bool ok;
+	bool update;
+	bool query_link;
+	bool query_addrs;
 	unsigned int ifindex;
 	struct in6_addr ifaddr;
 	uint8_t mac[6];
+
+	struct timespec next_advert;
+	struct timespec next_advert_earliest;
+
+	/* Token bucket limiting the unicast responses on this interface */
+	struct timespec solicit_tat;
+
+	uint16_t adv_default_lifetime;
+
+	size_t n_prefixes;
+	struct prefix *prefixes;
+
+	size_t n_rdnss;
+	struct rdnss *rdnss;
+
+	/* The serialized router advertisement, rebuilt when advert_valid is cleared */
+	bool advert_valid;
+	uint8_t *advert;
+	size_t advert_len;
+	uint8_t advert_cbuf[CMSG_SPACE(sizeof(struct in6_pktinfo))] __attribute__((aligned(8)));
+	size_t advert_cbuflen;
 };
 
 struct __attribute__((__packed__)) nd_opt_rdnss {
@@ -96,30 +159,36 @@ struct __attribute__((__packed__)) nd_opt_rdnss {
 	uint32_t nd_opt_rdnss_lifetime;
 };
 
+/* Token bucket of a soliciting host */
+struct solicit_source {
+	unsigned int ifindex;
+	struct in6_addr addr;
+	struct timespec tat;
+};
+
 static struct global {
-	struct iface iface;
+	size_t n_ifaces;
+	struct iface *ifaces;
+
+	bool unicast_solicited;
+	struct solicit_source solicit_sources[SOLICIT_SOURCES];
 
 	struct timespec time;
-	struct timespec next_advert;
-	struct timespec next_advert_earliest;
 
 	int icmp_sock;
 	int rtnl_sock;
+	int rtnl_query_sock;
+	uint32_t rtnl_seq;
 
-	const char *ifname;
-
-	uint16_t adv_default_lifetime;
+	const char *control_path;
+	int control_sock;
 
-	size_t n_prefixes;
-	struct in6_addr prefixes[MAX_PREFIXES];
-	bool prefixes_onlink[MAX_PREFIXES];
-
-	size_t n_rdnss;
-	struct in6_addr rdnss[MAX_RDNSS];
+	volatile sig_atomic_t stop;
 } G = {
 	.rtnl_sock = -1,
+	.rtnl_query_sock = -1,
+	.control_sock = -1,
 	.icmp_sock = -1,
-	.adv_default_lifetime = AdvDefaultLifetime,
 };
 
 
@@ -174,6 +243,26 @@ static inline void timespec_add(struct timespec *tp, unsigned int ms) {
 }
 
 
+/*
+  Takes a token from a bucket holding up to burst tokens, which is refilled by one
+  token every interval milliseconds. The bucket is represented by the theoretical
+  arrival time of the next token (*tat), so it doesn't need to be refilled explicitly.
+*/
+static bool take_token(struct timespec *tat, unsigned int interval, unsigned int burst) {
+	struct timespec limit = G.time;
+	timespec_add(&limit, interval * (burst-1));
+
+	if (timespec_after(tat, &limit))
+		return false;
+
+	if (timespec_after(&G.time, tat))
+		*tat = G.time;
+
+	timespec_add(tat, interval);
+	return true;
+}
+
+
 static inline int setsockopt_int(int socket, int level, int option, int value) {
 	return setsockopt(socket, level, option, &value, sizeof(value));
 }
@@ -198,6 +287,72 @@ static inline int rand_range(int min, int max) {
 	return (r%(max-min) + min);
 }
 
+/* Number of solicitation options checked by the socket filter; further options are checked by handle_solicit() */
+#define RS_FILTER_OPTIONS 4
+
+#define RS_FILTER_LEN (12 + 9*RS_FILTER_OPTIONS + 2)
+#define RS_FILTER_DROP(pc) (RS_FILTER_LEN - 1 - (pc) - 1)
+
+/*
+  Checks an option with X pointing at it and M[0] holding the message length;
+  n is the number of option checks following this one
+*/
+#define RS_FILTER_OPTION(n)							\
+	BPF_STMT(BPF_LD|BPF_MEM, 0),						\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_X, 0, 7 + 9*(n), 0),			\
+	BPF_STMT(BPF_LD|BPF_B|BPF_IND, 1),					\
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 6 + 9*(n), 0),			\
+	BPF_STMT(BPF_ALU|BPF_LSH|BPF_K, 3),					\
+	BPF_STMT(BPF_ALU|BPF_ADD|BPF_X, 0),					\
+	BPF_STMT(BPF_MISC|BPF_TAX, 0),						\
+	BPF_STMT(BPF_LD|BPF_MEM, 0),						\
+	BPF_JUMP(BPF_JMP|BPF_JGE|BPF_X, 0, 0, 1 + 9*(n))
+
+/*
+  Makes the kernel drop everything but router solicitations with hop limit 255,
+  whose options have non-zero lengths and fill the message exactly
+*/
+static void init_icmp_bpf(void) {
+	static struct sock_filter code[RS_FILTER_LEN] = {
+		/* Type and code */
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ND_ROUTER_SOLICIT, 0, RS_FILTER_DROP(1)),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 1),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, RS_FILTER_DROP(3)),
+
+		/* Hop limit from the IPv6 header */
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_NET_OFF + 7),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 255, 0, RS_FILTER_DROP(5)),
+
+		/* The options must be a multiple of 8 bytes */
+		BPF_STMT(BPF_LD|BPF_W|BPF_LEN, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_JUMP(BPF_JMP|BPF_JGE|BPF_K, sizeof(struct nd_router_solicit), 0, RS_FILTER_DROP(8)),
+		BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 7),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, RS_FILTER_DROP(10)),
+
+		BPF_STMT(BPF_LDX|BPF_IMM, sizeof(struct nd_router_solicit)),
+		RS_FILTER_OPTION(3),
+		RS_FILTER_OPTION(2),
+		RS_FILTER_OPTION(1),
+		RS_FILTER_OPTION(0),
+
+		/* Accept */
+		BPF_STMT(BPF_RET|BPF_K, 0xffffffff),
+
+		/* Drop */
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+
+	struct sock_fprog prog = {
+		.len = RS_FILTER_LEN,
+		.filter = code,
+	};
+
+	if (setsockopt(G.icmp_sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		warn_errno("can't attach socket filter");
+}
+
 static void init_icmp(void) {
 	G.icmp_sock = socket(AF_INET6, SOCK_RAW|SOCK_NONBLOCK, IPPROTO_ICMPV6);
 	if (G.icmp_sock < 0)
@@ -209,11 +364,47 @@ static void init_icmp(void) {
 	setsockopt_int(G.icmp_sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, 1);
 
 	setsockopt_int(G.icmp_sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, 1);
+	setsockopt_int(G.icmp_sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, 1);
 
 	struct icmp6_filter filter;
 	ICMP6_FILTER_SETBLOCKALL(&filter);
 	ICMP6_FILTER_SETPASS(ND_ROUTER_SOLICIT, &filter);
 	setsockopt(G.icmp_sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+
+	init_icmp_bpf();
+}
+
+/* Removes the control socket, so no stale socket is left behind on exit */
+static void remove_control(void) {
+	unlink(G.control_path);
+}
+
+static void init_control(void) {
+	if (!G.control_path)
+		return;
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(G.control_path) >= sizeof(addr.sun_path))
+		exit_error("control socket path too long", 0);
+
+	strncpy(addr.sun_path, G.control_path, sizeof(addr.sun_path)-1);
+
+	G.control_sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK, 0);
+	if (G.control_sock < 0)
+		exit_errno("can't open control socket");
+
+	unlink(G.control_path);
+
+	/* Only the owner may change the configuration */
+	mode_t old_umask = umask(077);
+	if (bind(G.control_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		exit_errno("can't bind control socket");
+	umask(old_umask);
+
+	atexit(remove_control);
 }
 
 static void init_rtnl(void) {
@@ -227,10 +418,29 @@ static void init_rtnl(void) {
 	};
 	if (bind(G.rtnl_sock, (struct sockaddr *)&snl, sizeof(snl)) < 0)
 		exit_errno("can't bind RTNL socket");
+
+	/* Queries are answered synchronously on a separate socket, so their replies don't mix with notifications */
+	G.rtnl_query_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+	if (G.rtnl_query_sock < 0)
+		exit_errno("can't open RTNL socket");
+
+	/* Makes the kernel filter address dumps by interface index (Linux 4.20+; older kernels dump everything) */
+	setsockopt_int(G.rtnl_query_sock, SOL_NETLINK, NETLINK_GET_STRICT_CHK, 1);
+}
+
+
+static struct iface * get_iface(unsigned int ifindex) {
+	size_t i;
+	for (i = 0; i < G.n_ifaces; i++) {
+		if (G.ifaces[i].ok && G.ifaces[i].ifindex == ifindex)
+			return &G.ifaces[i];
+	}
+
+	return NULL;
 }
 
 
-static void schedule_advert(bool nodelay) {
+static void schedule_advert(struct iface *iface, bool nodelay) {
 	struct timespec t = G.time;
 
 	if (nodelay)
@@ -238,15 +448,15 @@ static void schedule_advert(bool nodelay) {
 	else
 		timespec_add(&t, rand_range(MinRtrAdvInterval*1000, MaxRtrAdvInterval*1000));
 
-	if (timespec_after(&G.next_advert_earliest, &t))
-		t = G.next_advert_earliest;
+	if (timespec_after(&iface->next_advert_earliest, &t))
+		t = iface->next_advert_earliest;
 
-	if (!nodelay || timespec_after(&G.next_advert, &t))
-		G.next_advert = t;
+	if (!nodelay || timespec_after(&iface->next_advert, &t))
+		iface->next_advert = t;
 }
 
 
-static int join_multicast(void) {
+static int join_multicast(const struct iface *iface) {
 	struct ipv6_mreq mreq = {
 		.ipv6mr_multiaddr = {
 			.s6_addr = {
@@ -257,7 +467,7 @@ static int join_multicast(void) {
 				0x00, 0x00, 0x00, 0x02,
 			}
 		},
-		.ipv6mr_interface = G.iface.ifindex,
+		.ipv6mr_interface = iface->ifindex,
 	};
 
 	if (setsockopt(G.icmp_sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0) {
@@ -271,150 +481,297 @@ static int join_multicast(void) {
 	return 1;
 }
 
-static void update_interface(void) {
-	struct iface old;
-
-	memcpy(&old, &G.iface, sizeof(struct iface));
-	memset(&G.iface, 0, sizeof(struct iface));
+static void update_interface(struct iface *iface) {
+	iface->ok = false;
+	iface->update = false;
+	iface->advert_valid = false;
 
-	/* Update ifindex */
-	G.iface.ifindex = if_nametoindex(G.ifname);
-	if (!G.iface.ifindex)
+	if (!iface->ifindex || IN6_IS_ADDR_UNSPECIFIED(&iface->ifaddr))
 		return;
 
-	/* Update MAC address */
-	struct ifreq ifr = {};
-	strncpy(ifr.ifr_name, G.ifname, sizeof(ifr.ifr_name)-1);
-	if (ioctl(G.icmp_sock, SIOCGIFHWADDR, &ifr) < 0)
+	if (!join_multicast(iface))
 		return;
 
-	memcpy(G.iface.mac, ifr.ifr_hwaddr.sa_data, sizeof(G.iface.mac));
+	iface->ok = true;
 
-	struct ifaddrs *addrs, *addr;
-	if (getifaddrs(&addrs) < 0) {
-		warn_errno("getifaddrs");
+	schedule_advert(iface, true);
+}
+
+static void reset_interface(struct iface *iface) {
+	iface->update = true;
+	iface->query_addrs = false;
+	iface->ifindex = 0;
+	memset(&iface->ifaddr, 0, sizeof(iface->ifaddr));
+	memset(iface->mac, 0, sizeof(iface->mac));
+}
+
+
+static void handle_rtnl_link(struct iface *iface, const struct nlmsghdr *nh) {
+	const struct ifinfomsg *msg = NLMSG_DATA(nh);
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*msg)))
 		return;
-	}
 
-	memset(&G.iface.ifaddr, 0, sizeof(G.iface.ifaddr));
+	unsigned int ifindex = msg->ifi_index;
+	const char *ifname = NULL;
+	const uint8_t *mac = NULL;
+
+	const struct rtattr *rta;
+	int len = IFLA_PAYLOAD(nh);
+	for (rta = IFLA_RTA(msg); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			if (memchr(RTA_DATA(rta), 0, RTA_PAYLOAD(rta)))
+				ifname = RTA_DATA(rta);
+			break;
 
-	for (addr = addrs; addr; addr = addr->ifa_next) {
-		if (!addr->ifa_addr || addr->ifa_addr->sa_family != AF_INET6)
-			continue;
+		case IFLA_ADDRESS:
+			if (RTA_PAYLOAD(rta) == sizeof(iface->mac))
+				mac = RTA_DATA(rta);
+		}
+	}
 
-		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr->ifa_addr;
-		if (!IN6_IS_ADDR_LINKLOCAL(&in6->sin6_addr))
-			continue;
+	if (nh->nlmsg_type == RTM_DELLINK || !ifname || strcmp(ifname, iface->ifname) != 0) {
+		/* The interface was removed or renamed */
+		if (iface->ifindex && ifindex == iface->ifindex)
+			reset_interface(iface);
 
-		if (strncmp(addr->ifa_name, G.ifname, IFNAMSIZ-1) != 0)
-			continue;
+		return;
+	}
 
-		G.iface.ifaddr = in6->sin6_addr;
+	if (ifindex != iface->ifindex) {
+		reset_interface(iface);
+		iface->ifindex = ifindex;
+		iface->query_addrs = true;
 	}
 
-	freeifaddrs(addrs);
+	if (mac && memcmp(mac, iface->mac, sizeof(iface->mac)) != 0) {
+		memcpy(iface->mac, mac, sizeof(iface->mac));
+		iface->update = true;
+	}
+
+	if (!iface->ok)
+		iface->update = true;
+}
 
-	if (IN6_IS_ADDR_UNSPECIFIED(&G.iface.ifaddr))
+static void handle_rtnl_addr(struct iface *iface, const struct nlmsghdr *nh) {
+	const struct ifaddrmsg *msg = NLMSG_DATA(nh);
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*msg)))
 		return;
 
-	int joined = join_multicast();
-	if (!joined)
+	if (msg->ifa_family != AF_INET6 || !iface->ifindex || msg->ifa_index != iface->ifindex)
 		return;
 
-	setsockopt(G.icmp_sock, SOL_SOCKET, SO_BINDTODEVICE, G.ifname, strnlen(G.ifname, IFNAMSIZ-1));
+	struct in6_addr addr;
+	bool found = false;
 
-	G.iface.ok = true;
+	const struct rtattr *rta;
+	int len = IFA_PAYLOAD(nh);
+	for (rta = IFA_RTA(msg); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFA_ADDRESS && RTA_PAYLOAD(rta) == sizeof(addr)) {
+			memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+			found = true;
+		}
+	}
 
-	if (memcmp(&old, &G.iface, sizeof(struct iface)) != 0 || joined == 2)
-		schedule_advert(true);
-}
+	if (!found || !IN6_IS_ADDR_LINKLOCAL(&addr))
+		return;
 
+	switch (nh->nlmsg_type) {
+	case RTM_NEWADDR:
+		if (msg->ifa_flags & (IFA_F_TENTATIVE|IFA_F_DADFAILED))
+			return;
 
-static bool handle_rtnl_link(uint16_t type, const struct ifinfomsg *msg) {
-	switch (type) {
-	case RTM_NEWLINK:
-		if (!G.iface.ok)
-			return true;
+		if (IN6_IS_ADDR_UNSPECIFIED(&iface->ifaddr)) {
+			iface->ifaddr = addr;
+			iface->update = true;
+		}
+		else if (!iface->ok) {
+			iface->update = true;
+		}
 
 		break;
 
-	case RTM_SETLINK:
-		if ((unsigned)msg->ifi_index == G.iface.ifindex)
-			return true;
-
-		if (!G.iface.ok)
-			return true;
+	case RTM_DELADDR:
+		if (IN6_ARE_ADDR_EQUAL(&addr, &iface->ifaddr)) {
+			/* Look for another link-local address to use */
+			memset(&iface->ifaddr, 0, sizeof(iface->ifaddr));
+			iface->query_addrs = true;
+			iface->update = true;
+		}
+	}
+}
 
+static void handle_rtnl_msg(struct iface *iface, const struct nlmsghdr *nh) {
+	switch (nh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		handle_rtnl_link(iface, nh);
 		break;
 
-	case RTM_DELLINK:
-		if (G.iface.ok && (unsigned)msg->ifi_index == G.iface.ifindex)
-			return true;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		handle_rtnl_addr(iface, nh);
+	}
+}
+
+/*
+  Processes a buffer of netlink messages. Returns false when a request has been
+  completed by a NLMSG_DONE or NLMSG_ERROR message, storing its error code in *err.
+*/
+static bool handle_rtnl_buffer(const void *buffer, size_t len, int *err) {
+	size_t i;
+	const struct nlmsghdr *nh;
+	for (nh = buffer; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		switch (nh->nlmsg_type) {
+		case NLMSG_DONE:
+			*err = 0;
+			return false;
+
+		case NLMSG_ERROR:
+			if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr)))
+				*err = EINVAL;
+			else
+				*err = -((const struct nlmsgerr *)NLMSG_DATA(nh))->error;
+			return false;
+
+		default:
+			for (i = 0; i < G.n_ifaces; i++)
+				handle_rtnl_msg(&G.ifaces[i], nh);
+		}
 	}
 
-	return false;
+	return true;
 }
 
-static bool handle_rtnl_addr(uint16_t type, const struct ifaddrmsg *msg) {
-	switch (type) {
-	case RTM_NEWADDR:
-		if (!G.iface.ok && (unsigned)msg->ifa_index == G.iface.ifindex)
-			return true;
+/* Sends a request on the query socket and handles all replies; returns the error code of the request */
+static int rtnl_query(struct nlmsghdr *req) {
+	uint8_t buffer[8192] __attribute__((aligned(4)));
 
-		break;
+	req->nlmsg_seq = ++G.rtnl_seq;
 
-	case RTM_DELADDR:
-		if (G.iface.ok && (unsigned)msg->ifa_index == G.iface.ifindex)
-			return true;
+	if (send(G.rtnl_query_sock, req, req->nlmsg_len, 0) < 0) {
+		warn_errno("send");
+		return errno;
 	}
 
-	return false;
+	int err = 0;
+
+	while (true) {
+		ssize_t len = recv(G.rtnl_query_sock, buffer, sizeof(buffer), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			warn_errno("recv");
+			return errno;
+		}
+
+		if (!handle_rtnl_buffer(buffer, len, &err))
+			return err;
+	}
 }
 
-static bool handle_rtnl_msg(uint16_t type, const void *data) {
-	switch (type) {
-	case RTM_NEWLINK:
-	case RTM_DELLINK:
-	case RTM_SETLINK:
-		return handle_rtnl_link(type, data);
+static void query_link(struct iface *iface) {
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+		struct rtattr rta;
+		char ifname[IFNAMSIZ];
+	} req = {
+		.nh = {
+			.nlmsg_type = RTM_GETLINK,
+			.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK,
+		},
+		.ifi = {
+			.ifi_family = AF_UNSPEC,
+		},
+		.rta = {
+			.rta_type = IFLA_IFNAME,
+		},
+	};
 
-	case RTM_NEWADDR:
-	case RTM_DELADDR:
-		return handle_rtnl_addr(type, data);
+	size_t len = strnlen(iface->ifname, IFNAMSIZ-1);
+	memcpy(req.ifname, iface->ifname, len);
 
-	default:
-		return false;
+	req.rta.rta_len = RTA_LENGTH(len+1);
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi)) + RTA_SPACE(len+1);
+
+	if (rtnl_query(&req.nh) == ENODEV && iface->ifindex)
+		reset_interface(iface);
+}
+
+static void query_addrs(struct iface *iface) {
+	struct {
+		struct nlmsghdr nh;
+		struct ifaddrmsg ifa;
+	} req = {
+		.nh = {
+			.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa)),
+			.nlmsg_type = RTM_GETADDR,
+			.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP,
+		},
+		.ifa = {
+			.ifa_family = AF_INET6,
+			.ifa_index = iface->ifindex,
+		},
+	};
+
+	struct in6_addr old_ifaddr = iface->ifaddr;
+	bool update = iface->update;
+
+	memset(&iface->ifaddr, 0, sizeof(iface->ifaddr));
+	rtnl_query(&req.nh);
+
+	iface->update = update || !IN6_ARE_ADDR_EQUAL(&old_ifaddr, &iface->ifaddr);
+}
+
+/* Runs the queries requested by the netlink handlers and applies the resulting interface state */
+static void sync_interfaces(void) {
+	size_t i;
+	for (i = 0; i < G.n_ifaces; i++) {
+		struct iface *iface = &G.ifaces[i];
+
+		if (iface->query_link) {
+			iface->query_link = false;
+			query_link(iface);
+		}
+
+		if (iface->query_addrs) {
+			iface->query_addrs = false;
+			query_addrs(iface);
+		}
+
+		if (iface->update)
+			update_interface(iface);
 	}
 }
 
 static void handle_rtnl(void) {
-	char buffer[4096];
+	uint8_t buffer[8192] __attribute__((aligned(4)));
+	size_t i;
+	int err;
 
 	ssize_t len = recv(G.rtnl_sock, buffer, sizeof(buffer), 0);
 	if (len < 0) {
-		warn_errno("recv");
-		return;
-	}
-
-	const struct nlmsghdr *nh;
-	for (nh = (struct nlmsghdr *)buffer; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
-		switch (nh->nlmsg_type) {
-		case NLMSG_DONE:
+		if (errno != ENOBUFS) {
+			warn_errno("recv");
 			return;
+		}
 
-		case NLMSG_ERROR:
-			exit_error("netlink error", 0);
-
-		default:
-			if (handle_rtnl_msg(nh->nlmsg_type, NLMSG_DATA(nh))) {
-				update_interface();
-				return;
-			}
+		/* Notifications have been lost, so the interface state must be queried again */
+		for (i = 0; i < G.n_ifaces; i++) {
+			G.ifaces[i].query_link = true;
+			G.ifaces[i].query_addrs = true;
 		}
 	}
+	else {
+		handle_rtnl_buffer(buffer, len, &err);
+	}
+
+	sync_interfaces();
 }
 
-static void add_pktinfo(struct msghdr *msg) {
+static void add_pktinfo(struct msghdr *msg, const struct iface *iface) {
 	struct cmsghdr *cmsg = (struct cmsghdr*)((char*)msg->msg_control + msg->msg_controllen);
 
 	cmsg->cmsg_level = IPPROTO_IPV6;
@@ -424,14 +781,233 @@ static void add_pktinfo(struct msghdr *msg) {
 	msg->msg_controllen += cmsg->cmsg_len;
 
 	struct in6_pktinfo pktinfo = {
-		.ipi6_addr = G.iface.ifaddr,
-		.ipi6_ifindex = G.iface.ifindex,
+		.ipi6_addr = iface->ifaddr,
+		.ipi6_ifindex = iface->ifindex,
 	};
 
 	memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
 }
 
 
+/* Serializes the router advertisement of an interface, so it can be sent without further processing */
+static void build_advert(struct iface *iface) {
+	struct nd_router_advert advert = {
+		.nd_ra_hdr = {
+			.icmp6_type = ND_ROUTER_ADVERT,
+			.icmp6_dataun.icmp6_un_data8 = {AdvCurHopLimit, 0 /* Flags */, (iface->adv_default_lifetime>>8) & 0xff, iface->adv_default_lifetime & 0xff },
+		},
+	};
+
+	struct icmpv6_opt lladdr = {ND_OPT_SOURCE_LINKADDR, 1, {}};
+	memcpy(lladdr.data, iface->mac, sizeof(iface->mac));
+
+	struct nd_opt_prefix_info prefixes[iface->n_prefixes];
+
+	size_t i, j;
+	for (i = 0; i < iface->n_prefixes; i++) {
+		uint8_t flags = ND_OPT_PI_FLAG_AUTO;
+
+		if (iface->prefixes[i].onlink)
+			flags |= ND_OPT_PI_FLAG_ONLINK;
+
+		prefixes[i] = (struct nd_opt_prefix_info){
+			.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION,
+			.nd_opt_pi_len = 4,
+			.nd_opt_pi_prefix_len = 64,
+			.nd_opt_pi_flags_reserved = flags,
+			.nd_opt_pi_valid_time = htonl(iface->prefixes[i].valid_lifetime),
+			.nd_opt_pi_preferred_time = htonl(iface->prefixes[i].preferred_lifetime),
+			.nd_opt_pi_prefix = iface->prefixes[i].addr,
+		};
+	}
+
+	/*
+	  An RDNSS option carries a single lifetime, so the addresses are grouped
+	  into one option per distinct lifetime
+	*/
+	size_t n_rdnss_opts = 0;
+	for (i = 0; i < iface->n_rdnss; i++) {
+		for (j = 0; j < i; j++) {
+			if (iface->rdnss[j].lifetime == iface->rdnss[i].lifetime)
+				break;
+		}
+
+		if (j == i)
+			n_rdnss_opts++;
+	}
+
+	iface->advert_len = sizeof(advert) + sizeof(lladdr) + sizeof(prefixes)
+		+ n_rdnss_opts * sizeof(struct nd_opt_rdnss) + iface->n_rdnss * sizeof(struct in6_addr);
+
+	iface->advert = realloc(iface->advert, iface->advert_len);
+	if (!iface->advert)
+		exit_errno("realloc");
+
+	uint8_t *pos = iface->advert;
+	memcpy(pos, &advert, sizeof(advert));
+	pos += sizeof(advert);
+	memcpy(pos, &lladdr, sizeof(lladdr));
+	pos += sizeof(lladdr);
+	memcpy(pos, prefixes, sizeof(prefixes));
+	pos += sizeof(prefixes);
+
+	for (i = 0; i < iface->n_rdnss; i++) {
+		const uint32_t lifetime = iface->rdnss[i].lifetime;
+
+		for (j = 0; j < i; j++) {
+			if (iface->rdnss[j].lifetime == lifetime)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		struct nd_opt_rdnss *rdnss = (struct nd_opt_rdnss *)pos;
+		*rdnss = (struct nd_opt_rdnss){
+			.nd_opt_rdnss_type = 25,
+			.nd_opt_rdnss_len = 1,
+			.nd_opt_rdnss_lifetime = htonl(lifetime),
+		};
+		pos += sizeof(*rdnss);
+
+		for (j = i; j < iface->n_rdnss; j++) {
+			if (iface->rdnss[j].lifetime != lifetime)
+				continue;
+
+			memcpy(pos, iface->rdnss[j].addr.s6_addr, 16);
+			pos += 16;
+			rdnss->nd_opt_rdnss_len += 2;
+		}
+	}
+
+	struct msghdr msg = {
+		.msg_control = iface->advert_cbuf,
+		.msg_controllen = 0,
+	};
+
+	memset(iface->advert_cbuf, 0, sizeof(iface->advert_cbuf));
+	add_pktinfo(&msg, iface);
+	iface->advert_cbuflen = msg.msg_controllen;
+
+	iface->advert_valid = true;
+}
+
+static bool send_advert_to(struct iface *iface, const struct in6_addr *dest) {
+	if (!iface->advert_valid)
+		build_advert(iface);
+
+	struct iovec vec = { .iov_base = iface->advert, .iov_len = iface->advert_len };
+
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = *dest,
+		.sin6_scope_id = iface->ifindex,
+	};
+
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &vec,
+		.msg_iovlen = 1,
+		.msg_control = iface->advert_cbuf,
+		.msg_controllen = iface->advert_cbuflen,
+		.msg_flags = 0,
+	};
+
+	return (sendmsg(G.icmp_sock, &msg, 0) >= 0);
+}
+
+/* Drops the deleted prefixes that have been withdrawn often enough; returns true if some are left */
+static bool expire_withdrawn(struct iface *iface) {
+	bool withdrawing = false;
+	size_t i = 0;
+
+	while (i < iface->n_prefixes) {
+		struct prefix *prefix = &iface->prefixes[i];
+
+		if (!prefix->withdraw) {
+			i++;
+			continue;
+		}
+
+		if (--prefix->withdraw) {
+			withdrawing = true;
+			i++;
+			continue;
+		}
+
+		memmove(prefix, prefix+1, (iface->n_prefixes - i - 1) * sizeof(*prefix));
+		iface->n_prefixes--;
+		iface->advert_valid = false;
+	}
+
+	return withdrawing;
+}
+
+static void send_advert(struct iface *iface) {
+	static const struct in6_addr all_nodes = {
+		.s6_addr = {
+			0xff, 0x02, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x01,
+		}
+	};
+
+	if (!iface->ok)
+		return;
+
+	if (!send_advert_to(iface, &all_nodes)) {
+		iface->ok = false;
+		return;
+	}
+
+	iface->next_advert_earliest = G.time;
+	timespec_add(&iface->next_advert_earliest, MIN_DELAY_BETWEEN_RAS);
+
+	/* Withdrawals are repeated as soon as the rate limit allows */
+	schedule_advert(iface, expire_withdrawn(iface));
+}
+
+static struct solicit_source * get_solicit_source(const struct iface *iface, const struct in6_addr *addr) {
+	/* FNV-1a over the interface index and the address */
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(iface->ifindex); i++)
+		hash = (hash ^ ((iface->ifindex >> (8*i)) & 0xff)) * 16777619u;
+	for (i = 0; i < sizeof(addr->s6_addr); i++)
+		hash = (hash ^ addr->s6_addr[i]) * 16777619u;
+
+	struct solicit_source *source = &G.solicit_sources[hash % SOLICIT_SOURCES];
+
+	if (source->ifindex != iface->ifindex || !IN6_ARE_ADDR_EQUAL(&source->addr, addr))
+		*source = (struct solicit_source){
+			.ifindex = iface->ifindex,
+			.addr = *addr,
+		};
+
+	return source;
+}
+
+/*
+  Answers a solicitation with a unicast advertisement if the rate limits of the
+  soliciting host and the interface allow it; returns false if the solicitation
+  is to be answered by the next multicast advertisement instead.
+*/
+static bool answer_solicit(struct iface *iface, const struct in6_addr *addr) {
+	if (!G.unicast_solicited || IN6_IS_ADDR_UNSPECIFIED(addr))
+		return false;
+
+	struct solicit_source *source = get_solicit_source(iface, addr);
+	if (!take_token(&source->tat, SOLICIT_SOURCE_INTERVAL, SOLICIT_SOURCE_BURST))
+		return false;
+
+	if (!take_token(&iface->solicit_tat, SOLICIT_IFACE_INTERVAL, SOLICIT_IFACE_BURST))
+		return false;
+
+	return send_advert_to(iface, addr);
+}
+
 static void handle_solicit(void) {
 	struct sockaddr_in6 addr;
 
@@ -458,20 +1034,28 @@ static void handle_solicit(void) {
 		return;
 	}
 
+	struct iface *iface = NULL;
+
 	struct cmsghdr *cmsg;
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
 		if (cmsg->cmsg_level != IPPROTO_IPV6)
 			continue;
 
-		if (cmsg->cmsg_type != IPV6_HOPLIMIT)
-			continue;
+		switch (cmsg->cmsg_type) {
+		case IPV6_HOPLIMIT:
+			if (*(int*)CMSG_DATA(cmsg) != 255)
+				return;
 
-		if (*(int*)CMSG_DATA(cmsg) != 255)
-			return;
+			break;
 
-		break;
+		case IPV6_PKTINFO:
+			iface = get_iface(((struct in6_pktinfo *)CMSG_DATA(cmsg))->ipi6_ifindex);
+		}
 	}
 
+	if (!iface)
+		return;
+
 	const struct nd_router_solicit *s = (struct nd_router_solicit *)buffer;
 	if (s->nd_rs_hdr.icmp6_type != ND_ROUTER_SOLICIT || s->nd_rs_hdr.icmp6_code != 0)
 		return;
@@ -479,13 +1063,13 @@ static void handle_solicit(void) {
 	const struct icmpv6_opt *opt = (struct icmpv6_opt *)(buffer + sizeof(struct nd_router_solicit)), *end = (struct icmpv6_opt *)(buffer+len);
 
 	for (; opt < end; opt += opt->length) {
-		if (opt+1 < end)
+		if (opt+1 > end)
 			return;
 
 		if (!opt->length)
 			return;
 
-		if (opt+opt->length < end)
+		if (opt+opt->length > end)
 			return;
 
 		if (opt->type == ND_OPT_SOURCE_LINKADDR && IN6_IS_ADDR_UNSPECIFIED(&addr.sin6_addr))
@@ -495,164 +1079,336 @@ static void handle_solicit(void) {
 	if (opt != end)
 		return;
 
-	schedule_advert(true);
+	if (!answer_solicit(iface, &addr.sin6_addr))
+		schedule_advert(iface, true);
 }
 
-static void send_advert(void) {
-	if (!G.iface.ok)
-		return;
+static void usage(void) {
+	fprintf(stderr, "Usage: uradvd [-h] -i <interface> -a/-p <prefix> [ -a/-p <prefix> ... ] [ --default-lifetime <seconds> ] [ --rdnss <ip> ... ]\n"
+			"              [ -i <interface> -a/-p <prefix> ... ] [ --unicast-solicited ] [ --control <socket> ]\n");
+}
 
-	struct nd_router_advert advert = {
-		.nd_ra_hdr = {
-			.icmp6_type = ND_ROUTER_ADVERT,
-			.icmp6_dataun.icmp6_un_data8 = {AdvCurHopLimit, 0 /* Flags */, (G.adv_default_lifetime>>8) & 0xff, G.adv_default_lifetime & 0xff },
-		},
+static struct iface * add_iface(const char *ifname) {
+	size_t i;
+	for (i = 0; i < G.n_ifaces; i++) {
+		if (ifname && G.ifaces[i].ifname && strcmp(G.ifaces[i].ifname, ifname) == 0) {
+			fprintf(stderr, "uradvd: error: interface %s given multiple times.\n", ifname);
+			exit(1);
+		}
+	}
+
+	G.ifaces = realloc(G.ifaces, (G.n_ifaces+1) * sizeof(struct iface));
+	if (!G.ifaces)
+		exit_errno("realloc");
+
+	struct iface *iface = &G.ifaces[G.n_ifaces++];
+	*iface = (struct iface){
+		.ifname = ifname,
+		.adv_default_lifetime = AdvDefaultLifetime,
 	};
 
-	struct icmpv6_opt lladdr = {ND_OPT_SOURCE_LINKADDR, 1, {}};
-	memcpy(lladdr.data, G.iface.mac, sizeof(G.iface.mac));
+	return iface;
+}
 
-	struct nd_opt_prefix_info prefixes[G.n_prefixes];
+/*
+  Returns the interface the following options apply to: the one given by the
+  last -i option, or a new unnamed one that is filled in by the first -i
+*/
+static struct iface * current_iface(void) {
+	if (G.n_ifaces)
+		return &G.ifaces[G.n_ifaces-1];
 
-	size_t i;
-	for (i = 0; i < G.n_prefixes; i++) {
-		uint8_t flags = ND_OPT_PI_FLAG_AUTO;
+	return add_iface(NULL);
+}
 
-		if (G.prefixes_onlink[i])
-			flags |= ND_OPT_PI_FLAG_ONLINK;
+static size_t advert_len(size_t n_prefixes, size_t n_rdnss) {
+	size_t len = sizeof(struct nd_router_advert) + sizeof(struct icmpv6_opt) + n_prefixes * sizeof(struct nd_opt_prefix_info);
 
-		prefixes[i] = (struct nd_opt_prefix_info){
-			.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION,
-			.nd_opt_pi_len = 4,
-			.nd_opt_pi_prefix_len = 64,
-			.nd_opt_pi_flags_reserved = flags,
-			.nd_opt_pi_valid_time = htonl(AdvValidLifetime),
-			.nd_opt_pi_preferred_time = htonl(AdvPreferredLifetime),
-			.nd_opt_pi_prefix = G.prefixes[i],
-		};
+	/* Assume the worst case of one RDNSS option per address, as their lifetimes may differ */
+	len += n_rdnss * (sizeof(struct nd_opt_rdnss) + sizeof(struct in6_addr));
+
+	return len;
+}
+
+static bool parse_prefix(const char *prefix, struct in6_addr *addr) {
+	const size_t len = strlen(prefix)+1;
+	char prefix2[len];
+	memcpy(prefix2, prefix, len);
+
+	char *slash = strchr(prefix2, '/');
+	if (slash) {
+		*slash = 0;
+		if (strcmp(slash+1, "64") != 0)
+			return false;
 	}
 
-	struct nd_opt_rdnss rdnss = {};
-	uint8_t rdnss_ips[G.n_rdnss][16];
+	if (inet_pton(AF_INET6, prefix2, addr) != 1)
+		return false;
 
-	if (G.n_rdnss > 0) {
-		rdnss.nd_opt_rdnss_type = 25;
-		rdnss.nd_opt_rdnss_len = 1 + 2 * G.n_rdnss;
-		rdnss.nd_opt_rdnss_lifetime = htonl(AdvRDNSSLifetime);
+	static const uint8_t zero[8] = {};
+	return (memcmp(addr->s6_addr + 8, zero, 8) == 0);
+}
+
+static bool parse_lifetime(const char *lifetime, uint32_t *val) {
+	char *endptr;
+	errno = 0;
+	unsigned long long v = strtoull(lifetime, &endptr, 0);
+
+	if (!*lifetime || *endptr || errno || v > UINT32_MAX)
+		return false;
+
+	*val = v;
+	return true;
+}
 
-		for (i = 0; i < G.n_rdnss; i++)
-			memcpy(rdnss_ips[i], G.rdnss[i].s6_addr, 16);
+/*
+  The following functions modify the configuration of an interface. They
+  return NULL on success and an error message otherwise.
+*/
+
+/* A NULL lifetime selects the default */
+static const char * add_rdnss(struct iface *iface, const char *ip, const char *lifetime) {
+	struct in6_addr addr;
+	if (inet_pton(AF_INET6, ip, &addr) != 1)
+		return "invalid RDNSS IP address";
+
+	uint32_t val = AdvRDNSSLifetime;
+	if (lifetime && !parse_lifetime(lifetime, &val))
+		return "invalid RDNSS lifetime";
+
+	size_t i;
+	for (i = 0; i < iface->n_rdnss; i++) {
+		if (IN6_ARE_ADDR_EQUAL(&iface->rdnss[i].addr, &addr)) {
+			iface->rdnss[i].lifetime = val;
+			return NULL;
+		}
 	}
 
-	struct iovec vec[5] = {
-		{ .iov_base = &advert, .iov_len = sizeof(advert) },
-		{ .iov_base = &lladdr, .iov_len = sizeof(lladdr) },
-		{ .iov_base = prefixes, .iov_len = sizeof(prefixes) },
-		{ .iov_base = &rdnss, .iov_len = sizeof(rdnss) },
-		{ .iov_base = rdnss_ips, .iov_len = sizeof(rdnss_ips) }
-	};
+	if (advert_len(iface->n_prefixes, iface->n_rdnss+1) > MAX_ADVERT_LEN)
+		return "too many RDNSS IP addresses";
 
-	struct sockaddr_in6 addr = {
-		.sin6_family = AF_INET6,
-		.sin6_addr = {
-			.s6_addr = {
-				/* all-nodes address */
-				0xff, 0x02, 0x00, 0x00,
-				0x00, 0x00, 0x00, 0x00,
-				0x00, 0x00, 0x00, 0x00,
-				0x00, 0x00, 0x00, 0x01,
-			}
-		},
-		.sin6_scope_id = G.iface.ifindex,
+	iface->rdnss = realloc(iface->rdnss, (iface->n_rdnss+1) * sizeof(*iface->rdnss));
+	if (!iface->rdnss)
+		exit_errno("realloc");
+
+	iface->rdnss[iface->n_rdnss++] = (struct rdnss){
+		.addr = addr,
+		.lifetime = val,
 	};
+	return NULL;
+}
 
-	uint8_t cbuf[1024] __attribute__((aligned(8))) = {};
+static const char * del_rdnss(struct iface *iface, const char *ip) {
+	struct in6_addr addr;
+	if (inet_pton(AF_INET6, ip, &addr) != 1)
+		return "invalid RDNSS IP address";
 
-	struct msghdr msg = {
-		.msg_name = &addr,
-		.msg_namelen = sizeof(addr),
-		.msg_iov = vec,
-		.msg_iovlen = G.n_rdnss > 0 ? 5 : 3,
-		.msg_control = cbuf,
-		.msg_controllen = 0,
-		.msg_flags = 0,
+	size_t i;
+	for (i = 0; i < iface->n_rdnss; i++) {
+		if (!IN6_ARE_ADDR_EQUAL(&iface->rdnss[i].addr, &addr))
+			continue;
+
+		memmove(&iface->rdnss[i], &iface->rdnss[i+1], (iface->n_rdnss - i - 1) * sizeof(*iface->rdnss));
+		iface->n_rdnss--;
+		return NULL;
+	}
+
+	return "no such RDNSS IP address";
+}
+
+/*
+  A NULL valid lifetime selects the defaults; without a preferred lifetime,
+  the default one is used, limited to the valid lifetime
+*/
+static const char * add_prefix(struct iface *iface, const char *prefix, bool adv_onlink,
+			       const char *valid_lifetime, const char *preferred_lifetime) {
+	struct in6_addr addr;
+	if (!parse_prefix(prefix, &addr))
+		return "invalid prefix (only prefixes of length 64 are supported)";
+
+	uint32_t valid = AdvValidLifetime, preferred = AdvPreferredLifetime;
+	if (valid_lifetime) {
+		if (!parse_lifetime(valid_lifetime, &valid))
+			return "invalid valid lifetime";
+
+		if (preferred > valid)
+			preferred = valid;
+	}
+	if (preferred_lifetime && !parse_lifetime(preferred_lifetime, &preferred))
+		return "invalid preferred lifetime";
+
+	if (preferred > valid)
+		return "preferred lifetime exceeds valid lifetime";
+
+	size_t i;
+	for (i = 0; i < iface->n_prefixes; i++) {
+		if (IN6_ARE_ADDR_EQUAL(&iface->prefixes[i].addr, &addr)) {
+			iface->prefixes[i].onlink = adv_onlink;
+			iface->prefixes[i].valid_lifetime = valid;
+			iface->prefixes[i].preferred_lifetime = preferred;
+			iface->prefixes[i].withdraw = 0;
+			return NULL;
+		}
+	}
+
+	if (advert_len(iface->n_prefixes+1, iface->n_rdnss) > MAX_ADVERT_LEN)
+		return "too many prefixes";
+
+	iface->prefixes = realloc(iface->prefixes, (iface->n_prefixes+1) * sizeof(*iface->prefixes));
+	if (!iface->prefixes)
+		exit_errno("realloc");
+
+	iface->prefixes[iface->n_prefixes++] = (struct prefix){
+		.addr = addr,
+		.onlink = adv_onlink,
+		.valid_lifetime = valid,
+		.preferred_lifetime = preferred,
 	};
+	return NULL;
+}
 
-	add_pktinfo(&msg);
+static const char * del_prefix(struct iface *iface, const char *prefix) {
+	struct in6_addr addr;
+	if (!parse_prefix(prefix, &addr))
+		return "invalid prefix (only prefixes of length 64 are supported)";
 
-	if (sendmsg(G.icmp_sock, &msg, 0) < 0) {
-		G.iface.ok = false;
-		return;
+	size_t i;
+	for (i = 0; i < iface->n_prefixes; i++) {
+		struct prefix *p = &iface->prefixes[i];
+		if (!IN6_ARE_ADDR_EQUAL(&p->addr, &addr) || p->withdraw)
+			continue;
+
+		/* Deprecate the prefix, so hosts stop using it for new connections right away */
+		p->preferred_lifetime = 0;
+		if (p->valid_lifetime > WithdrawnValidLifetime)
+			p->valid_lifetime = WithdrawnValidLifetime;
+		p->withdraw = WITHDRAW_ADVERTS;
+		return NULL;
 	}
 
-	G.next_advert_earliest = G.time;
-	timespec_add(&G.next_advert_earliest, MIN_DELAY_BETWEEN_RAS);
+	return "no such prefix";
+}
+
+static const char * set_default_lifetime(struct iface *iface, const char *lifetime) {
+	char *endptr;
+	unsigned long val = strtoul(lifetime, &endptr, 0);
+
+	if (!*lifetime || *endptr || val > UINT16_MAX)
+		return "invalid default lifetime";
 
-	schedule_advert(false);
+	iface->adv_default_lifetime = val;
+	return NULL;
 }
 
+static void config_cmdline(const char *error, const char *arg) {
+	if (!error)
+		return;
 
-static void usage(void) {
-	fprintf(stderr, "Usage: uradvd [-h] -i <interface> -a/-p <prefix> [ -a/-p <prefix> ... ] [ --default-lifetime <seconds> ] [ --rdnss <ip> ... ]\n");
+	fprintf(stderr, "uradvd: error: %s: %s.\n", error, arg);
+	exit(1);
 }
 
-static void add_rdnss(const char *ip) {
-	if (G.n_rdnss == MAX_RDNSS) {
-		fprintf(stderr, "uradvd: error: maximum number of RDNSS IPs is %i.\n", MAX_RDNSS);
-		exit(1);
-	}
 
-	if (inet_pton(AF_INET6, ip, &G.rdnss[G.n_rdnss]) != 1) {
-		fprintf(stderr, "uradvd: error: invalid RDNSS IP address %s.\n", ip);
-		exit(1);
+static struct iface * find_iface(const char *ifname) {
+	size_t i;
+	for (i = 0; i < G.n_ifaces; i++) {
+		if (strcmp(G.ifaces[i].ifname, ifname) == 0)
+			return &G.ifaces[i];
 	}
 
-	G.n_rdnss++;
+	return NULL;
 }
 
-static void add_prefix(const char *prefix, bool adv_onlink) {
-	if (G.n_prefixes == MAX_PREFIXES) {
-		fprintf(stderr, "uradvd: error: maximum number of prefixes is %i.\n", MAX_PREFIXES);
-		exit(1);
-	}
+/*
+  Handles a control command of the form "<command> <interface> <argument>",
+  the commands being add-prefix, add-onlink-prefix, del-prefix, add-rdnss,
+  del-rdnss and default-lifetime. add-prefix and add-onlink-prefix take an
+  optional valid and preferred lifetime, add-rdnss an optional lifetime.
+  del-prefix deprecates the prefix and drops it after a few advertisements.
+*/
+static const char * handle_control_command(char *line) {
+	char *saveptr;
+	const char *command = strtok_r(line, " \t\n", &saveptr);
+	const char *ifname = strtok_r(NULL, " \t\n", &saveptr);
+	const char *arg = strtok_r(NULL, " \t\n", &saveptr);
+	const char *arg2 = arg ? strtok_r(NULL, " \t\n", &saveptr) : NULL;
+	const char *arg3 = arg2 ? strtok_r(NULL, " \t\n", &saveptr) : NULL;
+
+	if (!command || !ifname || !arg || (arg3 && strtok_r(NULL, " \t\n", &saveptr)))
+		return "invalid command";
+
+	struct iface *iface = find_iface(ifname);
+	if (!iface)
+		return "unknown interface";
+
+	const char *error;
+
+	if (strcmp(command, "add-prefix") == 0)
+		error = add_prefix(iface, arg, false, arg2, arg3);
+	else if (strcmp(command, "add-onlink-prefix") == 0)
+		error = add_prefix(iface, arg, true, arg2, arg3);
+	else if (arg3)
+		return "invalid command";
+	else if (strcmp(command, "add-rdnss") == 0)
+		error = add_rdnss(iface, arg, arg2);
+	else if (arg2)
+		return "invalid command";
+	else if (strcmp(command, "del-prefix") == 0)
+		error = del_prefix(iface, arg);
+	else if (strcmp(command, "del-rdnss") == 0)
+		error = del_rdnss(iface, arg);
+	else if (strcmp(command, "default-lifetime") == 0)
+		error = set_default_lifetime(iface, arg);
+	else
+		return "invalid command";
 
-	const size_t len = strlen(prefix)+1;
-	char prefix2[len];
-	memcpy(prefix2, prefix, len);
+	if (error)
+		return error;
 
-	char *slash = strchr(prefix2, '/');
-	if (slash) {
-		*slash = 0;
-		if (strcmp(slash+1, "64") != 0)
-			goto error;
+	/* Announce the new configuration right away */
+	iface->advert_valid = false;
+	schedule_advert(iface, true);
+
+	return NULL;
+}
+
+static void handle_control(void) {
+	char buffer[256];
+	struct sockaddr_un addr;
+	socklen_t addrlen = sizeof(addr);
+
+	ssize_t len = recvfrom(G.control_sock, buffer, sizeof(buffer)-1, 0, (struct sockaddr *)&addr, &addrlen);
+	if (len < 0) {
+		warn_errno("recvfrom");
+		return;
 	}
 
-	if (inet_pton(AF_INET6, prefix2, &G.prefixes[G.n_prefixes]) != 1)
-		goto error;
+	buffer[len] = 0;
 
-	static const uint8_t zero[8] = {};
-	if (memcmp(G.prefixes[G.n_prefixes].s6_addr + 8, zero, 8) != 0)
-		goto error;
+	const char *error = handle_control_command(buffer);
 
-	G.prefixes_onlink[G.n_prefixes] = adv_onlink;
+	/* Only clients that have bound their socket can receive a reply */
+	if (addrlen <= sizeof(sa_family_t))
+		return;
 
-	G.n_prefixes++;
-	return;
+	char reply[128];
+	if (error)
+		snprintf(reply, sizeof(reply), "error: %s\n", error);
+	else
+		snprintf(reply, sizeof(reply), "ok\n");
 
-error:
-	fprintf(stderr, "uradvd: error: invalid prefix %s (only prefixes of length 64 are supported).\n", prefix);
-	exit(1);
+	sendto(G.control_sock, reply, strlen(reply), 0, (struct sockaddr *)&addr, addrlen);
 }
 
 static void parse_cmdline(int argc, char *argv[]) {
 	int c;
-	char *endptr;
-	unsigned long val;
 
 	static struct option long_options[] =
 	{
 		{"default-lifetime", required_argument, 0, 0},
 		{"rdnss", required_argument, 0, 1},
+		{"unicast-solicited", no_argument, 0, 2},
+		{"control", required_argument, 0, 3},
 		{0, 0, 0, 0}
 	};
 
@@ -661,33 +1417,35 @@ static void parse_cmdline(int argc, char *argv[]) {
 	while ((c = getopt_long(argc, argv, "i:a:p:h", long_options, &option_index)) != -1) {
 		switch(c) {
 		case 0: // --default-lifetime
-			val = strtoul(optarg, &endptr, 0);
-
-			if (!*optarg || *endptr || val > UINT16_MAX)
-				exit_error("invalid default lifetime\n", 0);
-
-			G.adv_default_lifetime = val;
-
+			config_cmdline(set_default_lifetime(current_iface(), optarg), optarg);
 			break;
 
 		case 1: // --rdnss
-			add_rdnss(optarg);
+			config_cmdline(add_rdnss(current_iface(), optarg, NULL), optarg);
 			break;
 
-		case 'i':
-			if (G.ifname)
-				exit_error("multiple interfaces are not supported.\n", 0);
+		case 2: // --unicast-solicited
+			G.unicast_solicited = true;
+			break;
 
-			G.ifname = optarg;
+		case 'i':
+			if (G.n_ifaces == 1 && !G.ifaces[0].ifname)
+				G.ifaces[0].ifname = optarg;
+			else
+				add_iface(optarg);
 
 			break;
 
 		case 'a':
-			add_prefix(optarg, false);
+			config_cmdline(add_prefix(current_iface(), optarg, false, NULL, NULL), optarg);
 			break;
 
 		case 'p':
-			add_prefix(optarg, true);
+			config_cmdline(add_prefix(current_iface(), optarg, true, NULL, NULL), optarg);
+			break;
+
+		case 3: // --control
+			G.control_path = optarg;
 			break;
 
 		case 'h':
@@ -701,39 +1459,74 @@ static void parse_cmdline(int argc, char *argv[]) {
 	}
 }
 
+static void handle_signal(int sig __attribute__((unused))) {
+	G.stop = 1;
+}
+
 int main(int argc, char *argv[]) {
 	parse_cmdline(argc, argv);
 
-	if (!G.ifname || !G.n_prefixes)
+	if (!G.n_ifaces || !G.ifaces[0].ifname)
 		exit_error("interface and prefix arguments are required.\n", 0);
 
+	size_t i;
+	for (i = 0; i < G.n_ifaces; i++) {
+		if (!G.ifaces[i].n_prefixes)
+			exit_error("interface and prefix arguments are required.\n", 0);
+	}
+
 	init_random();
 	init_icmp();
 	init_rtnl();
+	init_control();
 
 	update_time();
-	G.next_advert = G.next_advert_earliest = G.time;
 
-	update_interface();
+	for (i = 0; i < G.n_ifaces; i++) {
+		struct iface *iface = &G.ifaces[i];
 
-	while (true) {
-		struct pollfd fds[2] = {
+		iface->next_advert = iface->next_advert_earliest = G.time;
+		iface->query_link = true;
+	}
+
+	sync_interfaces();
+
+	struct sigaction action = {
+		.sa_handler = handle_signal,
+	};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	while (!G.stop) {
+		struct pollfd fds[3] = {
 			{ .fd = G.icmp_sock, .events = POLLIN },
 			{ .fd = G.rtnl_sock, .events = POLLIN },
+			{ .fd = G.control_sock, .events = POLLIN },
 		};
 
 		int timeout = -1;
 
-		if (G.iface.ok) {
-			timeout = timespec_diff(&G.next_advert, &G.time);
+		for (i = 0; i < G.n_ifaces; i++) {
+			struct iface *iface = &G.ifaces[i];
+			if (!iface->ok)
+				continue;
 
-			if (timeout < 0)
-				timeout = 0;
+			int t = timespec_diff(&iface->next_advert, &G.time);
+			if (t < 0)
+				t = 0;
+
+			if (timeout < 0 || t < timeout)
+				timeout = t;
 		}
 
-		int ret = poll(fds, 2, timeout);
-		if (ret < 0)
+		int ret = poll(fds, 3, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
 			exit_errno("poll");
+		}
 
 		update_time();
 
@@ -741,8 +1534,16 @@ int main(int argc, char *argv[]) {
 			handle_solicit();
 		if (fds[1].revents & POLLIN)
 			handle_rtnl();
+		if (fds[2].revents & POLLIN)
+			handle_control();
 
-		if (timespec_after(&G.time, &G.next_advert))
-			send_advert();
+		for (i = 0; i < G.n_ifaces; i++) {
+			struct iface *iface = &G.ifaces[i];
+
+			if (timespec_after(&G.time, &iface->next_advert))
+				send_advert(iface);
+		}
 	}
+
+	return 0;
 }
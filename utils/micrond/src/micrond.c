@@ -24,10 +24,21 @@
 */
 
 
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,8 +59,51 @@ typedef struct job {
 	uint8_t dows;
 
 	char *command;
+
+	/* The command split into words, or NULL if it must be run by the shell */
+	char **argv;
+
+	/* Options; a max_running of 0 means unlimited */
+	unsigned max_running;
+	unsigned jitter;
+
+	unsigned running;
+
+	/* Statistics */
+	unsigned runs;
+	unsigned missed;
+	unsigned skipped;
+	time_t last_start;
+	long long last_duration;
+	int last_status;
+	bool finished;
+
+	time_t next_run;
+	size_t heap_index;
 } job_t;
 
+/* A running job; job is NULL when the job has been removed in the meantime */
+typedef struct child {
+	pid_t pid;
+	job_t *job;
+	struct timespec start;
+} child_t;
+
+/* The jobs read from a file in the crondir */
+typedef struct crontab {
+	struct crontab *next;
+
+	char *name;
+	job_t *jobs;
+	bool seen;
+} crontab_t;
+
+
+/* Jobs are searched up to 9 years ahead, so jobs for the 29th of February are found across non-leap centuries */
+#define MAX_SEARCH_YEARS 9
+
+#define NOT_SCHEDULED ((size_t)-1)
+
 
 static const char const *const MONTHS[12] = {
 	"jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"
@@ -61,12 +115,32 @@ static const char const *const WEEKDAYS[7] = {
 
 
 static const char *crondir;
+static const char *status_file = NULL;
+static bool status_dirty = false;
+
+static crontab_t *crontabs = NULL;
+
+static int inotify_fd = -1;
+static int signal_fd = -1;
+static int timer_fd = -1;
+
+/* Run jobs missed because the clock has moved forward once, instead of skipping them */
+static bool catch_up = false;
+
+extern char **environ;
+
+static posix_spawnattr_t spawn_attr;
 
-static job_t *jobs = NULL;
+static child_t *children = NULL;
+static size_t n_children = 0, children_size = 0;
+
+/* Min-heap of the scheduled jobs, ordered by their next execution time */
+static job_t **heap = NULL;
+static size_t heap_len = 0, heap_size = 0;
 
 
 static void usage(void) {
-	fprintf(stderr, "Usage: micrond <crondir>\n");
+	fprintf(stderr, "Usage: micrond [-s <statusfile>] [-c skip|once] <crondir>\n");
 }
 
 
@@ -141,7 +215,84 @@ static uint64_t parse_times(char *input, int min, int n) {
 	return ret;
 }
 
-static int handle_line(const char *line) {
+/*
+  Splits a command into words, if it can be executed without the help of
+  the shell. The words are stored in the same allocation as the array.
+*/
+static char ** split_command(const char *command) {
+	const char *const delim = " \t\n";
+
+	if (strpbrk(command, "|&;<>()$`\\\"'*?[]~!{}"))
+		return NULL;
+
+	/* Variable assignments */
+	size_t first_len = strcspn(command + strspn(command, delim), delim);
+	if (memchr(command + strspn(command, delim), '=', first_len))
+		return NULL;
+
+	size_t n = 0;
+	const char *pos = command;
+	while (*(pos += strspn(pos, delim))) {
+		n++;
+		pos += strcspn(pos, delim);
+	}
+
+	if (!n)
+		return NULL;
+
+	size_t len = strlen(command)+1;
+	char **argv = malloc((n+1) * sizeof(char *) + len);
+	if (!argv)
+		return NULL;
+
+	char *buf = (char *)(argv + n + 1), *saveptr;
+	memcpy(buf, command, len);
+
+	size_t i;
+	for (i = 0; i < n; i++)
+		argv[i] = strtok_r(i ? NULL : buf, delim, &saveptr);
+	argv[n] = NULL;
+
+	return argv;
+}
+
+/*
+  Parses a job option. Options are given between the time fields and the command:
+
+    @skip-running        Don't start the job while a previous instance is still running
+    @max-running=<n>     Don't start the job while n instances are running
+    @jitter=<seconds>    Delay the start by a random time of up to the given number of seconds
+*/
+static bool parse_option(job_t *job, const char *option) {
+	int val;
+
+	if (strcmp(option, "@skip-running") == 0) {
+		job->max_running = 1;
+		return true;
+	}
+
+	if (strncmp(option, "@max-running=", 13) == 0) {
+		val = strict_atoi(option+13);
+		if (val <= 0)
+			return false;
+
+		job->max_running = val;
+		return true;
+	}
+
+	if (strncmp(option, "@jitter=", 8) == 0) {
+		val = strict_atoi(option+8);
+		if (val < 0)
+			return false;
+
+		job->jitter = val;
+		return true;
+	}
+
+	return false;
+}
+
+static int handle_line(const char *line, job_t **jobs) {
 	job_t job = {};
 	int ret = -1;
 	char *columns[5];
@@ -182,13 +333,33 @@ static int handle_line(const char *line) {
 	if (!job.dows)
 		goto end;
 
-	job.command = strdup(line+len);
+	const char *command = line+len;
+	while (*command == '@') {
+		char *option;
+		int option_len;
+
+		if (sscanf(command, "%ms %n", &option, &option_len) < 1)
+			goto end;
+
+		bool valid = parse_option(&job, option);
+		free(option);
+
+		if (!valid)
+			goto end;
+
+		command += option_len;
+	}
+
+	job.command = strdup(command);
+	job.argv = split_command(command);
+
+	job.heap_index = NOT_SCHEDULED;
 
 	job_t *jobp = malloc(sizeof(job_t));
 	*jobp = job;
 
-	jobp->next = jobs;
-	jobs = jobp;
+	jobp->next = *jobs;
+	*jobs = jobp;
 
 	ret = 0;
 
@@ -200,15 +371,435 @@ static int handle_line(const char *line) {
 }
 
 
-static void read_crontab(const char *name) {
+static void run_job(job_t *job) {
+	if (job->max_running && job->running >= job->max_running) {
+		syslog(LOG_INFO, "not running job `%s': %u instance(s) still running", job->command, job->running);
+		job->skipped++;
+		status_dirty = true;
+		return;
+	}
+
+	if (n_children == children_size) {
+		size_t size = children_size ? 2*children_size : 16;
+		child_t *new_children = realloc(children, size * sizeof(child_t));
+		if (!new_children) {
+			syslog(LOG_ERR, "unable to run job: out of memory");
+			return;
+		}
+
+		children = new_children;
+		children_size = size;
+	}
+
+	pid_t pid;
+	int err = ENOENT;
+
+	if (job->argv)
+		err = posix_spawnp(&pid, job->argv[0], NULL, &spawn_attr, job->argv, environ);
+
+	/*
+	  Shell builtins aren't found in the PATH, and scripts without a #! line
+	  aren't passed to the shell by all libcs
+	*/
+	if (err == ENOENT || err == ENOEXEC) {
+		char *const argv[] = { "/bin/sh", "-c", job->command, NULL };
+		err = posix_spawn(&pid, "/bin/sh", NULL, &spawn_attr, argv, environ);
+	}
+
+	if (err) {
+		syslog(LOG_ERR, "unable to run job: %s", strerror(err));
+		return;
+	}
+
+	child_t *child = &children[n_children++];
+	*child = (child_t){
+		.pid = pid,
+		.job = job,
+	};
+	clock_gettime(CLOCK_MONOTONIC, &child->start);
+
+	job->running++;
+	job->runs++;
+	job->last_start = time(NULL);
+	status_dirty = true;
+}
+
+static void reap_children(void) {
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {}
+
+	struct timespec now;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		size_t i;
+		for (i = 0; i < n_children; i++) {
+			if (children[i].pid != pid)
+				continue;
+
+			job_t *job = children[i].job;
+			if (job) {
+				job->running--;
+				job->last_duration = (now.tv_sec - children[i].start.tv_sec) * 1000LL
+					+ (now.tv_nsec - children[i].start.tv_nsec) / 1000000;
+				job->last_status = status;
+				job->finished = true;
+				status_dirty = true;
+			}
+
+			children[i] = children[--n_children];
+			break;
+		}
+	}
+}
+
+/*
+  Writes a line of statistics for each job to the status file, replacing it
+  atomically. The status is given as exited:<code> or killed:<signal>.
+*/
+static void write_status(void) {
+	status_dirty = false;
+
+	if (!status_file)
+		return;
+
+	char tmp[strlen(status_file) + 5];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", status_file);
+
+	FILE *file = fopen(tmp, "w");
+	if (!file) {
+		syslog(LOG_WARNING, "unable to write status file `%s'", tmp);
+		return;
+	}
+
+	const crontab_t *crontab;
+	const job_t *job;
+	for (crontab = crontabs; crontab; crontab = crontab->next) {
+		for (job = crontab->jobs; job; job = job->next) {
+			char status[32] = "-";
+			if (job->finished && WIFEXITED(job->last_status))
+				snprintf(status, sizeof(status), "exited:%i", WEXITSTATUS(job->last_status));
+			else if (job->finished && WIFSIGNALED(job->last_status))
+				snprintf(status, sizeof(status), "killed:%i", WTERMSIG(job->last_status));
+
+			fprintf(file, "crontab=%s runs=%u missed=%u skipped=%u running=%u last_start=%lld duration=%lld status=%s command=%.*s\n",
+				crontab->name, job->runs, job->missed, job->skipped, job->running,
+				(long long)job->last_start, job->finished ? job->last_duration : -1LL, status,
+				(int)strcspn(job->command, "\n"), job->command);
+		}
+	}
+
+	if (fclose(file) || rename(tmp, status_file)) {
+		syslog(LOG_WARNING, "unable to write status file `%s'", status_file);
+		unlink(tmp);
+	}
+}
+
+static void init_timer(void) {
+	timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (timer_fd < 0)
+		syslog(LOG_WARNING, "unable to create timerfd, clock changes will be noticed late");
+}
+
+/*
+  Arms the timer for the next job. TFD_TIMER_CANCEL_ON_SET makes it fire
+  whenever the clock is set, so clock jumps are handled right away.
+*/
+static void arm_timer(time_t t) {
+	struct itimerspec its = {
+		/* Without jobs, the timer is only needed to notice clock changes */
+		.it_value.tv_sec = heap_len ? heap[0]->next_run : t + 86400,
+	};
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+		syslog(LOG_WARNING, "unable to arm timer");
+}
+
+static void handle_timer(void) {
+	uint64_t expirations;
+
+	/* Fails with ECANCELED if the clock has been set, which is handled by the main loop */
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN && errno != ECANCELED)
+		syslog(LOG_WARNING, "unable to read timer");
+}
+
+static void init_signals(void) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+
+	/* SIGCHLD is handled through signal_fd only */
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		fprintf(stderr, "Unable to create signalfd\n");
+		exit(1);
+	}
+
+	/* Jobs are started with all signals unblocked */
+	sigemptyset(&mask);
+	posix_spawnattr_init(&spawn_attr);
+	posix_spawnattr_setsigmask(&spawn_attr, &mask);
+	posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGMASK);
+}
+
+static void init_random(void) {
+	unsigned int seed = time(NULL) ^ getpid();
+
+	/* The seed must differ between nodes, so the jitter spreads their jobs */
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+			syslog(LOG_WARNING, "unable to read from /dev/urandom");
+
+		close(fd);
+	}
+
+	srandom(seed);
+}
+
+
+/* Returns the first time after t the job is to be run at, or -1 if there is none */
+static time_t job_next(const job_t *job, time_t t) {
+	struct tm tm;
+	localtime_r(&t, &tm);
+
+	int max_year = tm.tm_year + MAX_SEARCH_YEARS;
+
+	tm.tm_sec = 0;
+	tm.tm_min++;
+
+	while (1) {
+		tm.tm_isdst = -1;
+		time_t ret = mktime(&tm);
+
+		if (ret == (time_t)-1 || tm.tm_year > max_year)
+			return -1;
+
+		if (!(job->months & bit(tm.tm_mon))) {
+			tm.tm_mon++;
+			tm.tm_mday = 1;
+			tm.tm_hour = 0;
+			tm.tm_min = 0;
+		}
+		else if (!(job->doms & bit(tm.tm_mday-1)) || !(job->dows & bit(tm.tm_wday))) {
+			tm.tm_mday++;
+			tm.tm_hour = 0;
+			tm.tm_min = 0;
+		}
+		else if (!(job->hours & bit(tm.tm_hour))) {
+			tm.tm_hour++;
+			tm.tm_min = 0;
+		}
+		else if (!(job->minutes & bit(tm.tm_min)) || ret <= t) {
+			/* The second case may only happen for ambiguous local times when DST ends */
+			tm.tm_min++;
+		}
+		else {
+			return ret;
+		}
+	}
+}
+
+
+static void heap_set(size_t i, job_t *job) {
+	heap[i] = job;
+	job->heap_index = i;
+}
+
+static void heap_sift_up(size_t i) {
+	job_t *job = heap[i];
+
+	while (i > 0) {
+		size_t parent = (i-1)/2;
+		if (heap[parent]->next_run <= job->next_run)
+			break;
+
+		heap_set(i, heap[parent]);
+		i = parent;
+	}
+
+	heap_set(i, job);
+}
+
+static void heap_sift_down(size_t i) {
+	job_t *job = heap[i];
+
+	while (1) {
+		size_t child = 2*i + 1;
+		if (child >= heap_len)
+			break;
+
+		if (child+1 < heap_len && heap[child+1]->next_run < heap[child]->next_run)
+			child++;
+
+		if (job->next_run <= heap[child]->next_run)
+			break;
+
+		heap_set(i, heap[child]);
+		i = child;
+	}
+
+	heap_set(i, job);
+}
+
+static void heap_remove(job_t *job) {
+	size_t i = job->heap_index;
+	if (i == NOT_SCHEDULED)
+		return;
+
+	job->heap_index = NOT_SCHEDULED;
+
+	job_t *last = heap[--heap_len];
+	if (last == job)
+		return;
+
+	heap_set(i, last);
+	heap_sift_up(i);
+	heap_sift_down(last->heap_index);
+}
+
+/* (Re-)schedules a job for its first execution after t */
+static void schedule_job(job_t *job, time_t t) {
+	heap_remove(job);
+
+	job->next_run = job_next(job, t);
+	if (job->next_run == (time_t)-1)
+		return;
+
+	if (job->jitter)
+		job->next_run += random() % (job->jitter+1);
+
+	if (heap_len == heap_size) {
+		heap_size = heap_size ? 2*heap_size : 16;
+		heap = realloc(heap, heap_size * sizeof(job_t *));
+		if (!heap) {
+			syslog(LOG_ERR, "unable to schedule job: out of memory");
+			exit(1);
+		}
+	}
+
+	heap_set(heap_len++, job);
+	heap_sift_up(job->heap_index);
+}
+
+static void schedule_jobs(time_t t) {
+	crontab_t *crontab;
+	job_t *job;
+
+	for (crontab = crontabs; crontab; crontab = crontab->next) {
+		for (job = crontab->jobs; job; job = job->next)
+			schedule_job(job, t);
+	}
+}
+
+
+static void free_jobs(job_t *jobs) {
+	while (jobs) {
+		job_t *job = jobs;
+		jobs = job->next;
+
+		heap_remove(job);
+
+		size_t i;
+		for (i = 0; i < n_children; i++) {
+			if (children[i].job == job)
+				children[i].job = NULL;
+		}
+
+		free(job->command);
+		free(job->argv);
+		free(job);
+	}
+}
+
+/*
+  Carries the running instances and statistics of the old jobs over to the new
+  jobs with the same command and options, so a reload doesn't reset them.
+  Matched old jobs are removed from the list.
+*/
+static void inherit_jobs(job_t **old_jobs, job_t *jobs) {
+	job_t *job;
+	for (job = jobs; job; job = job->next) {
+		job_t **oldp;
+		for (oldp = old_jobs; *oldp; oldp = &(*oldp)->next) {
+			job_t *old = *oldp;
+			if (strcmp(old->command, job->command) == 0 &&
+			    old->max_running == job->max_running && old->jitter == job->jitter)
+				break;
+		}
+
+		job_t *old = *oldp;
+		if (!old)
+			continue;
+
+		job->running = old->running;
+		job->runs = old->runs;
+		job->missed = old->missed;
+		job->skipped = old->skipped;
+		job->last_start = old->last_start;
+		job->last_duration = old->last_duration;
+		job->last_status = old->last_status;
+		job->finished = old->finished;
+
+		size_t i;
+		for (i = 0; i < n_children; i++) {
+			if (children[i].job == old)
+				children[i].job = job;
+		}
+
+		*oldp = old->next;
+		old->next = NULL;
+		free_jobs(old);
+	}
+}
+
+static crontab_t ** find_crontab(const char *name) {
+	crontab_t **crontab;
+	for (crontab = &crontabs; *crontab; crontab = &(*crontab)->next) {
+		if (strcmp((*crontab)->name, name) == 0)
+			break;
+	}
+
+	return crontab;
+}
+
+static void remove_crontab(const char *name) {
+	crontab_t **crontabp = find_crontab(name);
+	crontab_t *crontab = *crontabp;
+	if (!crontab)
+		return;
+
+	*crontabp = crontab->next;
+
+	free_jobs(crontab->jobs);
+	free(crontab->name);
+	free(crontab);
+
+	status_dirty = true;
+}
+
+/*
+  (Re-)reads a crontab. The jobs previously read from the same file are only
+  replaced after the whole file has been parsed.
+*/
+static void read_crontab(const char *name, time_t t) {
 	FILE *file = fopen(name, "r");
 	if (!file) {
-		syslog(LOG_WARNING, "unable to read crontab `%s'", name);
+		if (errno != ENOENT)
+			syslog(LOG_WARNING, "unable to read crontab `%s'", name);
+
+		remove_crontab(name);
 		return;
 	}
 
 	char line[16384];
 	unsigned lineno = 0;
+	job_t *jobs = NULL;
 
 	while (fgets(line, sizeof(line), file)) {
 		lineno++;
@@ -217,100 +808,244 @@ static void read_crontab(const char *name) {
 		if (comment)
 			*comment = 0;
 
-		if (handle_line(line))
+		if (handle_line(line, &jobs))
 			syslog(LOG_WARNING, "syntax error in `%s', line %u", name, lineno);
 	}
 
 	fclose(file);
-}
 
+	crontab_t **crontabp = find_crontab(name);
+	crontab_t *crontab = *crontabp;
 
-static void read_crondir(void) {
-	DIR *dir;
-
-	if (chdir(crondir) || ((dir = opendir(".")) == NULL)) {
-		fprintf(stderr, "Unable to read crondir `%s'\n", crondir);
-		usage();
-		exit(1);
+	if (crontab) {
+		inherit_jobs(&crontab->jobs, jobs);
+		free_jobs(crontab->jobs);
 	}
+	else {
+		crontab = calloc(1, sizeof(crontab_t));
+		crontab->name = strdup(name);
+		*crontabp = crontab;
+	}
+
+	crontab->jobs = jobs;
+	crontab->seen = true;
+
+	status_dirty = true;
+
+	job_t *job;
+	for (job = jobs; job; job = job->next)
+		schedule_job(job, t);
+}
+
+/* Reads all crontabs and removes the ones whose files have disappeared */
+static bool read_crondir(time_t t) {
+	DIR *dir = opendir(".");
+	if (!dir)
+		return false;
+
+	crontab_t *crontab;
+	for (crontab = crontabs; crontab; crontab = crontab->next)
+		crontab->seen = false;
 
 	struct dirent *ent;
 	while ((ent = readdir(dir)) != NULL) {
 		if (ent->d_name[0] == '.')
 			continue;
 
-		read_crontab(ent->d_name);
+		read_crontab(ent->d_name, t);
 	}
 
 	closedir(dir);
+
+	crontab_t **crontabp = &crontabs;
+	while (*crontabp) {
+		crontab = *crontabp;
+
+		if (crontab->seen) {
+			crontabp = &crontab->next;
+			continue;
+		}
+
+		*crontabp = crontab->next;
+
+		free_jobs(crontab->jobs);
+		free(crontab->name);
+		free(crontab);
+
+		status_dirty = true;
+	}
+
+	return true;
 }
 
 
-static void run_job(const job_t *job) {
-	pid_t pid = fork();
-	if (pid == 0) {
-		execl("/bin/sh", "/bin/sh", "-c", job->command, (char*)NULL);
-		syslog(LOG_ERR, "unable to run job: exec failed");
-		_exit(1);
+static void init_inotify(void) {
+	inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		syslog(LOG_WARNING, "unable to watch crondir: inotify_init1 failed");
+		return;
 	}
-	else if (pid < 0) {
-		syslog(LOG_ERR, "unable to run job: fork failed");
+
+	if (inotify_add_watch(inotify_fd, ".", IN_CREATE|IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE) < 0) {
+		syslog(LOG_WARNING, "unable to watch crondir `%s'", crondir);
+		close(inotify_fd);
+		inotify_fd = -1;
 	}
 }
 
+/* Re-reads the crontabs that have been changed, added or removed */
+static void handle_inotify(void) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
 
-static void check_job(const job_t *job, const struct tm *tm) {
-	if (!(job->minutes & bit(tm->tm_min)))
-		return;
+	while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+		time_t t = time(NULL);
+		const struct inotify_event *event;
+		char *pos;
 
-	if (!(job->hours & bit(tm->tm_hour)))
-		return;
+		for (pos = buffer; pos < buffer + len; pos += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)pos;
 
-	if (!(job->doms & bit(tm->tm_mday-1)))
-		return;
+			if (event->mask & IN_Q_OVERFLOW) {
+				if (!read_crondir(t))
+					syslog(LOG_WARNING, "unable to read crondir `%s'", crondir);
 
-	if (!(job->months & bit(tm->tm_mon)))
-		return;
+				continue;
+			}
 
-	if (!(job->dows & bit(tm->tm_wday)))
-		return;
+			if (!event->len || event->name[0] == '.')
+				continue;
 
-	run_job(job);
+			if (event->mask & (IN_DELETE|IN_MOVED_FROM))
+				remove_crontab(event->name);
+			else
+				read_crontab(event->name, t);
+		}
+	}
 }
 
 
 int main(int argc, char *argv[]) {
-	if (argc != 2) {
+	int c;
+	while ((c = getopt(argc, argv, "s:c:h")) != -1) {
+		switch (c) {
+		case 's':
+			status_file = optarg;
+			break;
+
+		case 'c':
+			if (strcmp(optarg, "once") == 0) {
+				catch_up = true;
+			}
+			else if (strcmp(optarg, "skip") == 0) {
+				catch_up = false;
+			}
+			else {
+				usage();
+				exit(1);
+			}
+
+			break;
+
+		case 'h':
+			usage();
+			exit(0);
+
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (argc - optind != 1) {
 		usage();
 
-		exit(argc < 2 ? 0 : 1);
+		exit(argc - optind < 1 ? 0 : 1);
+	}
+
+	crondir = argv[optind];
+
+	/* The status file must not end up in the crondir, which is made the working directory */
+	if (status_file && status_file[0] != '/') {
+		fprintf(stderr, "The status file path must be absolute\n");
+		exit(1);
 	}
 
-	crondir = argv[1];
+	init_signals();
+	init_timer();
+	init_random();
 
-	signal(SIGCHLD, SIG_IGN);
+	if (chdir(crondir)) {
+		fprintf(stderr, "Unable to read crondir `%s'\n", crondir);
+		usage();
+		exit(1);
+	}
 
-	read_crondir();
+	/* Start watching before the initial read, so no change can be missed */
+	init_inotify();
 
-	time_t t = time(NULL);
-	struct tm *tm = localtime(&t);
-	int minute = tm->tm_min;
+	time_t last = time(NULL);
+
+	if (!read_crondir(last)) {
+		fprintf(stderr, "Unable to read crondir `%s'\n", crondir);
+		usage();
+		exit(1);
+	}
 
 	while (1) {
-		sleep(60 - t%60);
+		time_t t = time(NULL);
 
-		t = time(NULL);
-		tm = localtime(&t);
+		if (t < last) {
+			/* clock has moved backwards, start over */
+			schedule_jobs(t);
+		}
 
-		minute = (minute+1)%60;
-		if (tm->tm_min != minute) {
-			/* clock has moved, don't execute jobs */
-			minute = tm->tm_min;
-			continue;
+		last = t;
+
+		while (heap_len && heap[0]->next_run <= t) {
+			job_t *job = heap[0];
+
+			/*
+			  Jobs missed because the clock has moved forward are run once
+			  or skipped, depending on the catch-up policy
+			*/
+			if (t - job->next_run >= 60) {
+				job->missed++;
+				status_dirty = true;
+			}
+
+			if (t - job->next_run < 60 || catch_up)
+				run_job(job);
+
+			schedule_job(job, t);
 		}
 
-		job_t *job;
-		for (job = jobs; job; job = job->next)
-			check_job(job, tm);
+		int timeout = -1;
+		if (timer_fd >= 0) {
+			arm_timer(t);
+		}
+		else if (heap_len) {
+			time_t diff = heap[0]->next_run - t;
+			timeout = (diff < INT_MAX/1000) ? diff*1000 : INT_MAX;
+		}
+
+		if (status_dirty)
+			write_status();
+
+		struct pollfd fds[3] = {
+			{ .fd = inotify_fd, .events = POLLIN },
+			{ .fd = signal_fd, .events = POLLIN },
+			{ .fd = timer_fd, .events = POLLIN },
+		};
+
+		if (poll(fds, 3, timeout) <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN)
+			handle_inotify();
+		if (fds[1].revents & POLLIN)
+			reap_children();
+		if (fds[2].revents & POLLIN)
+			handle_timer();
 	}
 }